@@ -28,6 +28,7 @@
 #include <SDL.h>
 #include <SDL_thread.h>
 #include <map>
+#include "bufferpool.h"
 #include "types.h"
 
 class AudioManager;
@@ -71,6 +72,12 @@ public:
 	void setBalance(const AudioHandle &handle, int8 balance);
 	int8 getBalance(const AudioHandle &handle);
 
+	/**
+	 * Buffers for sample data that's handed to streams. The pool outlives
+	 * all streams, which may still be queued when a video is closed.
+	 */
+	BufferPool &getBufferPool() { return _bufferPool; }
+
 private:
 	void callbackHandler(byte *samples, int len);
 	static void sdlCallback(void *manager, byte *samples, int len);
@@ -107,6 +114,8 @@ private:
 	typedef std::map<uint, Channel *> ChannelMap;
 	ChannelMap _channels;
 	uint _channelSeed;
+
+	BufferPool _bufferPool;
 };
 
 #endif
@@ -0,0 +1,644 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <SDL.h>
+
+#include "benchmark.h"
+#include "bomp.h"
+#include "graphicsman.h"
+#include "pcm.h"
+#include "scaler.h"
+#include "threadpool.h"
+#include "util.h"
+
+// Time func over enough iterations to run for about half a second and
+// return the average in microseconds
+template<typename Func>
+static double timeIterations(Func func) {
+	const Uint64 freq = SDL_GetPerformanceFrequency();
+	uint iterations = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	Uint64 elapsed;
+
+	do {
+		func();
+		iterations++;
+		elapsed = SDL_GetPerformanceCounter() - start;
+	} while (elapsed < freq / 2);
+
+	return elapsed * 1000000.0 / freq / iterations;
+}
+
+// BOMP data with a mix of fill and literal runs of all lengths, roughly
+// like the blast objects found in real videos
+static std::vector<byte> makeBompData(int len) {
+	std::vector<byte> data;
+	int pos = 0;
+
+	while (pos < len) {
+		int num = 1 + rand() % 128;
+		bool fill = rand() % 3 != 0;
+		data.push_back(((num - 1) << 1) | (fill ? 1 : 0));
+
+		if (fill)
+			data.push_back(rand());
+		else
+			for (int i = 0; i < num; i++)
+				data.push_back(rand());
+
+		pos += num;
+	}
+
+	return data;
+}
+
+// The decoders as they were before the shared engine, for comparison
+static void baselineDecodeLine(byte *dst, const byte *src, int len) {
+	while (len > 0) {
+		byte code = *src++;
+		byte num = (code >> 1) + 1;
+
+		if (num > len)
+			num = len;
+
+		len -= num;
+
+		if (code & 1) {
+			byte color = *src++;
+			memset(dst, color, num);
+		} else {
+			memcpy(dst, src, num);
+			src += num;
+		}
+
+		dst += num;
+	}
+}
+
+static void baselineDecodeLine16(uint16 *dst, const byte *src, int len, const byte *table) {
+	// Blocky16's old byte at a time state machine
+	int left = 2, num = 0;
+	byte color = 0;
+
+	while (len--) {
+		if (left == 2) {
+			num = (*src >> 1) + 1;
+			left = *src++ & 1;
+
+			if (left)
+				color = *src++;
+		}
+
+		byte index = left ? color : *src++;
+
+		if (--num == 0)
+			left = 2;
+
+		*dst++ = READ_LE_UINT16(table + index * 2);
+	}
+}
+
+static void baselineDecodeMain16(byte *dst, const byte *src, int len) {
+	// The same state machine, run a byte at a time for Blocky16's
+	// straight RLE frames
+	int left = 2, num = 0;
+	byte color = 0;
+
+	while (len--) {
+		if (left == 2) {
+			num = (*src >> 1) + 1;
+			left = *src++ & 1;
+
+			if (left)
+				color = *src++;
+		}
+
+		*dst++ = left ? color : *src++;
+
+		if (--num == 0)
+			left = 2;
+	}
+}
+
+struct BompCallSite {
+	const char *name;
+	int width, height;
+	int bytesPerPixel;
+	bool lut;
+};
+
+static void benchmarkBomp() {
+	static const BompCallSite callSites[] = {
+		{ "Codec37 case 2", 320, 200, 1, false },
+		{ "Codec47 case 5", 640, 480, 1, false },
+		{ "Codec48 case 2", 640, 480, 1, false },
+		{ "Blocky16 case 5", 640, 480, 2, false },
+		{ "Blocky16 case 8", 640, 480, 2, true }
+	};
+
+	srand(1);
+
+	printf("%-16s %10s %12s %12s\n", "Call site", "Size", "Before (us)", "After (us)");
+
+	for (int i = 0; i < ARRAYSIZE(callSites); i++) {
+		const BompCallSite &site = callSites[i];
+		int pixels = site.width * site.height;
+		int len = site.lut ? pixels : pixels * site.bytesPerPixel;
+		std::vector<byte> data = makeBompData(len);
+		std::vector<byte> frame(pixels * site.bytesPerPixel);
+		const byte *src = &data[0];
+		const byte *end = src + data.size();
+		byte table[512];
+		double before, after;
+
+		for (int j = 0; j < 512; j++)
+			table[j] = rand();
+
+		if (site.lut) {
+			uint16 *dst = (uint16 *)&frame[0];
+			before = timeIterations([&] { baselineDecodeLine16(dst, src, len, table); });
+			after = timeIterations([&] { bompDecodeLine16(dst, src, len, table); });
+		} else if (site.bytesPerPixel == 2) {
+			byte *dst = &frame[0];
+			before = timeIterations([&] { baselineDecodeMain16(dst, src, len); });
+			after = timeIterations([&] { bompDecodeLine(dst, src, end, len); });
+		} else {
+			byte *dst = &frame[0];
+			before = timeIterations([&] { baselineDecodeLine(dst, src, len); });
+			after = timeIterations([&] { bompDecodeLine(dst, src, end, len); });
+		}
+
+		printf("%-16s %4dx%-5d %12.1f %12.1f\n", site.name, site.width, site.height, before, after);
+	}
+}
+
+struct ScaleCase {
+	const char *name;
+	Scaler::Mode mode;
+	bool aspectRatio;
+};
+
+// Time converting and scaling a frame with the CPU scalers and through
+// SDL's software renderer, which is what scaling with
+// SDL_RenderSetLogicalSize() comes down to without a GPU
+static void benchmarkScale() {
+	static const ScaleCase cases[] = {
+		{ "2x", Scaler::kModeNearest2x, false },
+		{ "3x", Scaler::kModeNearest3x, false },
+		{ "smooth2x", Scaler::kModeSmooth2x, false },
+		{ "aspect", Scaler::kModeNone, true },
+		{ "2x+aspect", Scaler::kModeNearest2x, true },
+		{ "3x+aspect", Scaler::kModeNearest3x, true }
+	};
+
+	const int width = 320, height = 200;
+	std::vector<byte> frame(width * height);
+	uint32 lut[256];
+
+	srand(1);
+
+	for (int i = 0; i < 256; i++)
+		lut[i] = 0xFF000000 | ((rand() & 0xFFFF) << 8) | (rand() & 0xFF);
+
+	// Flat 8x8 blocks with some noise, so the smoother has edges to find
+	for (int y = 0; y < height; y += 8) {
+		for (int x = 0; x < width; x += 8) {
+			byte color = rand() % 16;
+
+			for (int i = 0; i < 8; i++)
+				memset(&frame[(y + i) * width + x], color, 8);
+		}
+	}
+
+	for (int i = 0; i < width * height / 16; i++)
+		frame[rand() % (width * height)] = rand();
+
+	printf("%-10s %8s %10s %10s\n", "Scaler", "Output", "CPU (us)", "SDL (us)");
+
+	for (int i = 0; i < ARRAYSIZE(cases); i++) {
+		const ScaleCase &scaleCase = cases[i];
+		Scaler scaler;
+		scaler.setMode(scaleCase.mode, scaleCase.aspectRatio);
+
+		int outWidth = scaler.getScaledWidth(width);
+		int outHeight = scaler.getScaledHeight(height);
+		std::vector<uint32> output(outWidth * outHeight);
+		Rect outRect = scaler.getOutputRect(Rect(0, 0, width, height), width, height);
+
+		double cpu = timeIterations([&] { scaler.scale((byte *)&output[0], outWidth * 4, outRect, &frame[0], width, width, height, lut); });
+
+		// SDL's equivalent of the smoother is linear filtering
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, (scaleCase.mode == Scaler::kModeSmooth2x) ? "linear" : "nearest");
+
+		SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, outWidth, outHeight, 32, SDL_PIXELFORMAT_ARGB8888);
+		SDL_Renderer *renderer = surface ? SDL_CreateSoftwareRenderer(surface) : 0;
+		SDL_Texture *texture = renderer ? SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height) : 0;
+		double sdl = -1.0;
+
+		if (texture) {
+			sdl = timeIterations([&] {
+				void *pixels;
+				int pitch;
+				SDL_LockTexture(texture, 0, &pixels, &pitch);
+
+				for (int y = 0; y < height; y++)
+					convertIndexLine((uint32 *)((byte *)pixels + y * pitch), &frame[y * width], width, lut);
+
+				SDL_UnlockTexture(texture);
+				SDL_RenderCopy(renderer, texture, 0, 0);
+				SDL_RenderPresent(renderer);
+			});
+		}
+
+		printf("%-10s %4dx%-4d %10.1f ", scaleCase.name, outWidth, outHeight, cpu);
+
+		if (sdl < 0.0)
+			printf("%10s\n", "n/a");
+		else
+			printf("%10.1f\n", sdl);
+
+		if (texture)
+			SDL_DestroyTexture(texture);
+		if (renderer)
+			SDL_DestroyRenderer(renderer);
+		if (surface)
+			SDL_FreeSurface(surface);
+	}
+}
+
+struct PresentCase {
+	const char *name;
+	int width, height;
+	bool highColor;
+	Scaler::Mode mode;
+	bool aspectRatio;
+};
+
+// Time the whole display path, from uploading a frame to presenting it,
+// with GraphicsManager drawing offscreen through SDL's software renderer
+static void benchmarkPresent() {
+	static const PresentCase cases[] = {
+		{ "320x200", 320, 200, false, Scaler::kModeNone, false },
+		{ "320x200 2x+aspect", 320, 200, false, Scaler::kModeNearest2x, true },
+		{ "320x200 smooth2x", 320, 200, false, Scaler::kModeSmooth2x, false },
+		{ "640x480", 640, 480, false, Scaler::kModeNone, false },
+		{ "640x480 16bpp", 640, 480, true, Scaler::kModeNone, false }
+	};
+
+	srand(1);
+
+	printf("%-18s %12s %14s\n", "Frames", "Full (us)", "Partial (us)");
+
+	// Convert big frames in bands, as the player does
+	ThreadPool threadPool;
+
+	for (int i = 0; i < ARRAYSIZE(cases); i++) {
+		const PresentCase &presentCase = cases[i];
+		int pitch = presentCase.width * (presentCase.highColor ? 2 : 1);
+		std::vector<byte> frame(pitch * presentCase.height);
+		byte palette[256 * 3];
+
+		for (uint j = 0; j < frame.size(); j++)
+			frame[j] = rand();
+
+		for (int j = 0; j < 256 * 3; j++)
+			palette[j] = rand();
+
+		GraphicsManager gfx;
+		gfx.setScaler(presentCase.mode, presentCase.aspectRatio);
+		gfx.setThreadPool(&threadPool);
+
+		if (!gfx.initOffscreen(presentCase.width, presentCase.height, presentCase.highColor)) {
+			printf("%-18s %12s %14s\n", presentCase.name, "n/a", "n/a");
+			continue;
+		}
+
+		gfx.setPalette(palette, 0, 256);
+
+		// Every frame changes entirely
+		DirtyRegion all;
+		all.addAll();
+
+		double full = timeIterations([&] {
+			gfx.blit(&frame[0], pitch, all);
+			gfx.update();
+		});
+
+		// A 64x64 sprite moving across an otherwise still frame
+		int x = 0;
+
+		double partial = timeIterations([&] {
+			DirtyRegion region;
+			region.addRect(Rect(x, 64, x + 64, 128));
+			x = (x + 8) % (presentCase.width - 64);
+
+			gfx.blit(&frame[0], pitch, region);
+			gfx.update();
+		});
+
+		printf("%-18s %12.1f %14.1f\n", presentCase.name, full, partial);
+	}
+}
+
+// A motion vector for each 8x8 block, in pixels. A quarter of the blocks
+// don't move, like the blocks codec 47 copies from the previous frame; the
+// rest move up to 43 pixels either way, the range of codec 47's table.
+struct BlockMotion {
+	int x, y;
+};
+
+static std::vector<BlockMotion> makeBlockMotion(int width, int height) {
+	std::vector<BlockMotion> motion((width / 8) * (height / 8));
+
+	for (uint i = 0; i < motion.size(); i++) {
+		int blockX = i % (width / 8) * 8, blockY = i / (width / 8) * 8;
+		int x = blockX, y = blockY;
+
+		if (rand() % 4 != 0) {
+			x += rand() % 87 - 43;
+			y += rand() % 87 - 43;
+		}
+
+		motion[i].x = CLIP(x, 0, width - 8);
+		motion[i].y = CLIP(y, 0, height - 8);
+	}
+
+	return motion;
+}
+
+// The source rows of a block copy, as byte ranges within the buffer
+struct BlockSpan {
+	uint32 offset, size;
+};
+
+template<int BPP>
+static int getRowMajorSpans(BlockSpan *spans, int width, int x, int y) {
+	for (int i = 0; i < 8; i++) {
+		spans[i].offset = ((y + i) * width + x) * BPP;
+		spans[i].size = 8 * BPP;
+	}
+
+	return 8;
+}
+
+// 8x8 block-major: each block is 64 pixels in a row, with the blocks in
+// the usual order. A block that isn't on the grid is gathered from the
+// two or four blocks it overlaps.
+template<int BPP>
+static inline uint32 getTileOffset(int width, int x, int y) {
+	return (((y >> 3) * (width >> 3) + (x >> 3)) * 64 + (y & 7) * 8) * BPP;
+}
+
+template<int BPP>
+static int getTiledSpans(BlockSpan *spans, int width, int x, int y) {
+	int count = 0;
+
+	for (int i = 0; i < 8; i++) {
+		uint32 offset = getTileOffset<BPP>(width, x, y + i);
+		spans[count].offset = offset + (x & 7) * BPP;
+		spans[count++].size = (8 - (x & 7)) * BPP;
+
+		if (x & 7) {
+			spans[count].offset = offset + 64 * BPP;
+			spans[count++].size = (x & 7) * BPP;
+		}
+	}
+
+	return count;
+}
+
+// Count the cache lines a block copy reads. There are no cache miss
+// counters to read here, so this is the best portable stand-in.
+static int countCacheLines(const BlockSpan *spans, int count) {
+	uint32 lines[64];
+	int lineCount = 0;
+
+	for (int i = 0; i < count; i++) {
+		for (uint32 line = spans[i].offset / 64; line <= (spans[i].offset + spans[i].size - 1) / 64; line++) {
+			bool found = false;
+
+			for (int j = 0; j < lineCount && !found; j++)
+				found = lines[j] == line;
+
+			if (!found)
+				lines[lineCount++] = line;
+		}
+	}
+
+	return lineCount;
+}
+
+template<int BPP>
+static void copyBlocksRowMajor(byte *dst, const byte *src, int width, int height, const std::vector<BlockMotion> &motion) {
+	const BlockMotion *m = &motion[0];
+	int pitch = width * BPP;
+
+	for (int y = 0; y < height; y += 8) {
+		for (int x = 0; x < width; x += 8, m++) {
+			byte *d = dst + y * pitch + x * BPP;
+			const byte *s = src + m->y * pitch + m->x * BPP;
+
+			for (int i = 0; i < 8; i++)
+				memcpy(d + i * pitch, s + i * pitch, 8 * BPP);
+		}
+	}
+}
+
+template<int BPP>
+static void copyBlocksTiled(byte *dst, const byte *src, int width, int height, const std::vector<BlockMotion> &motion) {
+	const BlockMotion *m = &motion[0];
+
+	for (int y = 0; y < height; y += 8) {
+		for (int x = 0; x < width; x += 8, m++) {
+			byte *d = dst + getTileOffset<BPP>(width, x, y);
+			int shift = (m->x & 7) * BPP;
+
+			if (!(m->x & 7) && !(m->y & 7)) {
+				memcpy(d, src + getTileOffset<BPP>(width, m->x, m->y), 64 * BPP);
+				continue;
+			}
+
+			const byte *s = src + getTileOffset<BPP>(width, m->x, m->y);
+
+			for (int i = 0; i < 8; i++) {
+				// Move down to the next row of blocks part way through
+				if (i > 0 && ((m->y + i) & 7) == 0)
+					s = src + getTileOffset<BPP>(width, m->x, m->y + i);
+
+				// Put the row together from the two blocks with shifts,
+				// rather than through memory, which would stall on store
+				// forwarding. (This is little endian only, but it's only
+				// being timed.)
+				uint64 words[2 * BPP] = { 0 }, out[BPP];
+				memcpy(words, s, 8 * BPP);
+
+				if (shift)
+					memcpy(words + BPP, s + 64 * BPP, 8 * BPP);
+
+				for (int j = 0; j < BPP; j++) {
+					uint64 low = words[j + shift / 8];
+					int bits = (shift & 7) * 8;
+					out[j] = bits ? (low >> bits) | (words[j + shift / 8 + 1] << (64 - bits)) : low;
+				}
+
+				memcpy(d + i * 8 * BPP, out, 8 * BPP);
+				s += 8 * BPP;
+			}
+		}
+	}
+}
+
+// Turn a block-major frame back into rows, which the row-major layout
+// never has to do
+template<int BPP>
+static void untileFrame(byte *dst, const byte *src, int width, int height) {
+	for (int y = 0; y < height; y += 8) {
+		for (int x = 0; x < width; x += 8) {
+			for (int i = 0; i < 8; i++) {
+				memcpy(dst + ((y + i) * width + x) * BPP, src, 8 * BPP);
+				src += 8 * BPP;
+			}
+		}
+	}
+}
+
+template<int BPP>
+static void benchmarkLayout(const char *name, int width, int height) {
+	uint32 frameSize = width * height * BPP;
+	std::vector<BlockMotion> motion = makeBlockMotion(width, height);
+	std::vector<byte> rowMajor(frameSize * 3), tiled(frameSize * 3), output(frameSize);
+
+	for (uint i = 0; i < rowMajor.size(); i++)
+		rowMajor[i] = tiled[i] = rand();
+
+	BlockSpan spans[16];
+	long rowMajorLines = 0, tiledLines = 0;
+
+	for (uint i = 0; i < motion.size(); i++) {
+		rowMajorLines += countCacheLines(spans, getRowMajorSpans<BPP>(spans, width, motion[i].x, motion[i].y));
+		tiledLines += countCacheLines(spans, getTiledSpans<BPP>(spans, width, motion[i].x, motion[i].y));
+	}
+
+	// Like the codecs, rotate through three buffers so that the source is
+	// always the frame before
+	int frame = 0;
+	double rowMajorTime = timeIterations([&] {
+		frame = (frame + 1) % 3;
+		copyBlocksRowMajor<BPP>(&rowMajor[frame * frameSize], &rowMajor[(frame + 2) % 3 * frameSize], width, height, motion);
+	});
+
+	double tiledTime = timeIterations([&] {
+		frame = (frame + 1) % 3;
+		copyBlocksTiled<BPP>(&tiled[frame * frameSize], &tiled[(frame + 2) % 3 * frameSize], width, height, motion);
+	});
+
+	double untileTime = timeIterations([&] { untileFrame<BPP>(&output[0], &tiled[0], width, height); });
+
+	printf("%-10s %7dKB %8.2f %8.2f %10.1f %10.1f %10.1f\n", name, frameSize * 3 / 1024,
+			(double)rowMajorLines / motion.size(), (double)tiledLines / motion.size(),
+			rowMajorTime, tiledTime, untileTime);
+}
+
+// Motion compensation in codec 47 and blocky16 with row-major delta
+// buffers, as they are, against an 8x8 block-major layout
+static void benchmarkLayouts() {
+	srand(1);
+
+	printf("%-10s %9s %17s %32s\n", "", "", "Lines per block", "Time per frame (us)");
+	printf("%-10s %9s %8s %8s %10s %10s %10s\n", "Codec", "Buffers", "Rows", "Blocks", "Rows", "Blocks", "Untile");
+
+	benchmarkLayout<1>("Codec 47", 640, 480);
+	benchmarkLayout<2>("Blocky16", 640, 480);
+}
+
+// iMuse's sample unpacking as it was before the SSE2 versions
+static void baselineUnpack12(int16 *dst, const byte *src, uint32 count) {
+	while (count--) {
+		byte v1 = *src++;
+		byte v2 = *src++;
+		byte v3 = *src++;
+		*dst++ = ((((v2 & 0xF) << 8) | v1) << 4) - 0x8000;
+		*dst++ = ((((v2 & 0xF0) << 4) | v3) << 4) - 0x8000;
+	}
+}
+
+static void baselineConvert8(int16 *dst, const byte *src, uint32 count) {
+	while (count--)
+		*dst++ = (int16)((*src++ ^ 0x80) << 8);
+}
+
+// Time unpacking a second of 22050Hz stereo iMuse audio, the most that
+// The Dig's videos queue at once
+static void benchmarkIMuse() {
+	const uint32 samples = 22050 * 2;
+	std::vector<byte> data(samples * 3 / 2);
+	std::vector<int16> before(samples), after(samples);
+
+	srand(1);
+
+	for (uint i = 0; i < data.size(); i++)
+		data[i] = rand();
+
+	printf("%-8s %12s %12s\n", "Format", "Before (us)", "After (us)");
+
+	double scalar = timeIterations([&] { baselineUnpack12(&before[0], &data[0], samples / 2); });
+	double vector = timeIterations([&] { unpack12BitSamples(&after[0], &data[0], samples / 2); });
+	printf("%-8s %12.1f %12.1f%s\n", "12-bit", scalar, vector, (before == after) ? "" : " (mismatch)");
+
+	scalar = timeIterations([&] { baselineConvert8(&before[0], &data[0], samples); });
+	vector = timeIterations([&] { convertUnsigned8BitSamples(&after[0], &data[0], samples); });
+	printf("%-8s %12.1f %12.1f%s\n", "8-bit", scalar, vector, (before == after) ? "" : " (mismatch)");
+}
+
+struct Benchmark {
+	const char *name;
+	const char *description;
+	void (*func)();
+};
+
+static const Benchmark s_benchmarks[] = {
+	{ "bomp", "BOMP RLE decoding at each codec's call site", benchmarkBomp },
+	{ "scale", "CPU scalers against scaling with SDL's software renderer", benchmarkScale },
+	{ "present", "Uploading and presenting frames with an offscreen renderer", benchmarkPresent },
+	{ "imuse", "Unpacking 12-bit and 8-bit iMuse samples", benchmarkIMuse },
+	{ "layout", "Row-major against block-major delta buffers at 640x480", benchmarkLayouts }
+};
+
+bool runBenchmark(const char *name) {
+	for (int i = 0; i < ARRAYSIZE(s_benchmarks); i++) {
+		if (!strcmp(s_benchmarks[i].name, name)) {
+			s_benchmarks[i].func();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void listBenchmarks() {
+	for (int i = 0; i < ARRAYSIZE(s_benchmarks); i++)
+		printf("  %-12s %s\n", s_benchmarks[i].name, s_benchmarks[i].description);
+}
@@ -0,0 +1,35 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/**
+ * Run the named benchmark on synthetic data and print the results.
+ * Returns false if there's no benchmark by that name.
+ */
+bool runBenchmark(const char *name);
+
+/** Print the names of the available benchmarks */
+void listBenchmarks();
+
+#endif
@@ -0,0 +1,144 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "blitters.h"
+
+void blitTransparent(byte *dst, const byte *src, uint len) {
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+
+	while (len >= 16) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)src);
+		__m128i mask = _mm_cmpeq_epi8(pixels, zero);
+
+		// Fully opaque runs are the common case in sprites
+		if (_mm_movemask_epi8(mask) == 0) {
+			_mm_storeu_si128((__m128i *)dst, pixels);
+		} else if (_mm_movemask_epi8(mask) != 0xFFFF) {
+			__m128i old = _mm_loadu_si128((const __m128i *)dst);
+			_mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(mask, old), _mm_andnot_si128(mask, pixels)));
+		}
+
+		src += 16;
+		dst += 16;
+		len -= 16;
+	}
+#endif
+
+	while (len--) {
+		byte val = *src++;
+
+		if (val)
+			*dst = val;
+
+		dst++;
+	}
+}
+
+void fillPixelPairs(byte *dst, byte pixel1, byte pixel2, uint count, bool transparent) {
+	if (transparent && (pixel1 == 0 || pixel2 == 0)) {
+		// At most one of the two pixels gets drawn
+		if (pixel1 == 0 && pixel2 == 0)
+			return;
+
+		int offset = (pixel1 != 0) ? 0 : 1;
+		byte pixel = pixel1 | pixel2;
+
+		for (uint i = 0; i < count; i++)
+			dst[i * 2 + offset] = pixel;
+
+		return;
+	}
+
+	if (pixel1 == pixel2) {
+		memset(dst, pixel1, count * 2);
+		return;
+	}
+
+#ifdef __SSE2__
+	const __m128i pattern = _mm_set1_epi16((short)(pixel1 | (pixel2 << 8)));
+
+	while (count >= 8) {
+		_mm_storeu_si128((__m128i *)dst, pattern);
+		dst += 16;
+		count -= 8;
+	}
+#endif
+
+	while (count--) {
+		*dst++ = pixel1;
+		*dst++ = pixel2;
+	}
+}
+
+void unpackNibbles(byte *dst, const byte *src, uint len, byte offset, bool transparent) {
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowMask = _mm_set1_epi8(0x0F);
+	const __m128i add = _mm_set1_epi8((char)offset);
+
+	while (len >= 16) {
+		__m128i packed = _mm_loadu_si128((const __m128i *)src);
+		__m128i low = _mm_and_si128(packed, lowMask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), lowMask);
+
+		// Interleave to get the pixels back in stream order
+		__m128i nibbles[2];
+		nibbles[0] = _mm_unpacklo_epi8(low, high);
+		nibbles[1] = _mm_unpackhi_epi8(low, high);
+
+		for (int i = 0; i < 2; i++) {
+			__m128i pixels = _mm_add_epi8(nibbles[i], add);
+
+			if (transparent) {
+				__m128i mask = _mm_cmpeq_epi8(nibbles[i], zero);
+				__m128i old = _mm_loadu_si128((const __m128i *)(dst + i * 16));
+				pixels = _mm_or_si128(_mm_and_si128(mask, old), _mm_andnot_si128(mask, pixels));
+			}
+
+			_mm_storeu_si128((__m128i *)(dst + i * 16), pixels);
+		}
+
+		src += 16;
+		dst += 32;
+		len -= 16;
+	}
+#endif
+
+	while (len--) {
+		byte val = *src++;
+		byte pixel1 = val & 0xF;
+		byte pixel2 = val >> 4;
+
+		if (!transparent || pixel1 != 0)
+			dst[0] = pixel1 + offset;
+
+		if (!transparent || pixel2 != 0)
+			dst[1] = pixel2 + offset;
+
+		dst += 2;
+	}
+}
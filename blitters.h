@@ -0,0 +1,49 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef BLITTERS_H
+#define BLITTERS_H
+
+#include "types.h"
+
+// Pixel run kernels for the sprite-style frame object codecs (1/3/21/31/32).
+// Palette index 0 is transparent in the transparent variants.
+
+/**
+ * Copy len pixels from src to dst, leaving dst untouched wherever the
+ * source pixel is 0.
+ */
+void blitTransparent(byte *dst, const byte *src, uint len);
+
+/**
+ * Fill count pairs of pixels with pixel1, pixel2. A pixel of 0 is
+ * skipped when transparent is set.
+ */
+void fillPixelPairs(byte *dst, byte pixel1, byte pixel2, uint count, bool transparent);
+
+/**
+ * Expand len bytes into 2 * len pixels, low nibble first, adding offset
+ * to each nibble. Zero nibbles are skipped when transparent is set.
+ */
+void unpackNibbles(byte *dst, const byte *src, uint len, byte offset, bool transparent);
+
+#endif
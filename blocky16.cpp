@@ -26,6 +26,8 @@
 #include <string.h>
 #include <SDL_endian.h>
 #include "blocky16.h"
+#include "bomp.h"
+#include "framebuffer.h"
 #include "util.h"
 
 #define COPY_4X1_LINE(dst, src)			\
@@ -343,7 +345,9 @@ void Blocky16::makeTables47(int width) {
 	} while (c < 32768);
 }
 
+template<int PITCH>
 void Blocky16::level3(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp2;
 	uint32 t;
 	byte code = *_d_src++;
@@ -360,12 +364,12 @@ void Blocky16::level3(byte *d_dst) {
 		tmp2 += _offset1;
 		for (i = 0; i < 2; i++) {
 			COPY_4X1_LINE(d_dst + 0, d_dst + tmp2 + 0);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if ((code == 0xFF) || (code == 0xF8)) {
 		WRITE_2X1_LINE(d_dst + 0, READ_LE_UINT16(_d_src + 0));
 		WRITE_2X1_LINE(d_dst + 2, READ_LE_UINT16(_d_src + 2));
-		d_dst += _d_pitch;
+		d_dst += pitch;
 		WRITE_2X1_LINE(d_dst + 0, READ_LE_UINT16(_d_src + 4));
 		WRITE_2X1_LINE(d_dst + 2, READ_LE_UINT16(_d_src + 6));
 		_d_src += 8;
@@ -375,7 +379,7 @@ void Blocky16::level3(byte *d_dst) {
 		t = (t << 16) | t;
 		for (i = 0; i < 2; i++) {
 			WRITE_4X1_LINE(d_dst + 0, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFE) {
 		t = READ_LE_UINT16(_d_src);
@@ -383,13 +387,13 @@ void Blocky16::level3(byte *d_dst) {
 		t = (t << 16) | t;
 		for (i = 0; i < 2; i++) {
 			WRITE_4X1_LINE(d_dst + 0, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xF6) {
 		tmp2 = _offset2;
 		for (i = 0; i < 2; i++) {
 			COPY_4X1_LINE(d_dst + 0, d_dst + tmp2 + 0);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xF7) {
 		tmp2 = READ_LE_UINT32(_d_src);
@@ -397,7 +401,7 @@ void Blocky16::level3(byte *d_dst) {
 		WRITE_2X1_LINE(d_dst + 0, READ_LE_UINT16(_param6_7Ptr + (byte)tmp2 * 2));
 		WRITE_2X1_LINE(d_dst + 2, READ_LE_UINT16(_param6_7Ptr + (byte)(tmp2 >> 8) * 2));
 		tmp2 >>= 16;
-		d_dst += _d_pitch;
+		d_dst += pitch;
 		WRITE_2X1_LINE(d_dst + 0, READ_LE_UINT16(_param6_7Ptr + (byte)tmp2 * 2));
 		WRITE_2X1_LINE(d_dst + 2, READ_LE_UINT16(_param6_7Ptr + (byte)(tmp2 >> 8) * 2));
 	} else if ((code >= 0xF9) && (code <= 0xFC))  {
@@ -405,12 +409,14 @@ void Blocky16::level3(byte *d_dst) {
 		t = (t << 16) | t;
 		for (i = 0; i < 2; i++) {
 			WRITE_4X1_LINE(d_dst + 0, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	}
 }
 
+template<int PITCH>
 void Blocky16::level2(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp2;
 	uint32 t = 0, val;
 	byte code = *_d_src++;
@@ -428,22 +434,22 @@ void Blocky16::level2(byte *d_dst) {
 		for (i = 0; i < 4; i++) {
 			COPY_4X1_LINE(d_dst +  0, d_dst + tmp2 +  0);
 			COPY_4X1_LINE(d_dst +  4, d_dst + tmp2 +  4);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFF) {
-		level3(d_dst);
+		level3<PITCH>(d_dst);
 		d_dst += 4;
-		level3(d_dst);
-		d_dst += _d_pitch * 2 - 4;
-		level3(d_dst);
+		level3<PITCH>(d_dst);
+		d_dst += pitch * 2 - 4;
+		level3<PITCH>(d_dst);
 		d_dst += 4;
-		level3(d_dst);
+		level3<PITCH>(d_dst);
 	} else if (code == 0xF6) {
 		tmp2 = _offset2;
 		for (i = 0; i < 4; i++) {
 			COPY_4X1_LINE(d_dst +  0, d_dst + tmp2 +  0);
 			COPY_4X1_LINE(d_dst +  4, d_dst + tmp2 +  4);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if ((code == 0xF7) || (code == 0xF8)) {
 		byte tmp = *_d_src++;
@@ -486,12 +492,14 @@ void Blocky16::level2(byte *d_dst) {
 		for (i = 0; i < 4; i++) {
 			WRITE_4X1_LINE(d_dst + 0, t);
 			WRITE_4X1_LINE(d_dst + 4, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	}
 }
 
+template<int PITCH>
 void Blocky16::level1(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp2;
 	uint32 t = 0, val;
 	byte code = *_d_src++;
@@ -511,16 +519,16 @@ void Blocky16::level1(byte *d_dst) {
 			COPY_4X1_LINE(d_dst +  4, d_dst + tmp2 +  4);
 			COPY_4X1_LINE(d_dst +  8, d_dst + tmp2 +  8);
 			COPY_4X1_LINE(d_dst + 12, d_dst + tmp2 + 12);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFF) {
-		level2(d_dst);
+		level2<PITCH>(d_dst);
 		d_dst += 8;
-		level2(d_dst);
-		d_dst += _d_pitch * 4 - 8;
-		level2(d_dst);
+		level2<PITCH>(d_dst);
+		d_dst += pitch * 4 - 8;
+		level2<PITCH>(d_dst);
 		d_dst += 8;
-		level2(d_dst);
+		level2<PITCH>(d_dst);
 	} else if (code == 0xF6) {
 		tmp2 = _offset2;
 		for (i = 0; i < 8; i++) {
@@ -528,7 +536,7 @@ void Blocky16::level1(byte *d_dst) {
 			COPY_4X1_LINE(d_dst +  4, d_dst + tmp2 +  4);
 			COPY_4X1_LINE(d_dst +  8, d_dst + tmp2 +  8);
 			COPY_4X1_LINE(d_dst + 12, d_dst + tmp2 + 12);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if ((code == 0xF7) || (code == 0xF8)) {
 		byte tmp = *_d_src++;
@@ -573,24 +581,25 @@ void Blocky16::level1(byte *d_dst) {
 			WRITE_4X1_LINE(d_dst +  4, t);
 			WRITE_4X1_LINE(d_dst +  8, t);
 			WRITE_4X1_LINE(d_dst + 12, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	}
 }
 
+template<int PITCH>
 void Blocky16::decode2(byte *dst, const byte *src, int width, int height, const byte *param_ptr, const byte *param6_7_ptr) {
 	_d_src = src;
 	_paramPtr = param_ptr - 0xf9 - 0xf9;
 	_param6_7Ptr = param6_7_ptr;
 	int bw = (width + 7) / 8;
 	int bh = (height + 7) / 8;
-	int next_line = width * 2 * 7;
+	int next_line = (PITCH ? PITCH : width * 2) * 7;
 	_d_pitch = width * 2;
 
 	do {
 		int tmp_bw = bw;
 		do {
-			level1(dst);
+			level1<PITCH>(dst);
 			dst += 16;
 		} while (--tmp_bw);
 		dst += next_line;
@@ -598,6 +607,7 @@ void Blocky16::decode2(byte *dst, const byte *src, int width, int height, const
 }
 
 Blocky16::Blocky16(uint width, uint height) {
+	_lastTableWidth = -1;
 	_tableBig = new byte[99328];
 	_tableSmall = new byte[32768];
 	memset(_tableBig, 0, 99328);
@@ -613,17 +623,40 @@ Blocky16::Blocky16(uint width, uint height) {
 	// lol, byeruba, crushed, eldepot, heltrain, hostage
 	// but for tb_kitty.snm 5700 bytes is needed
 	_deltaSize = _frameSize * 3 + 5700;
-	_deltaBuf = new byte[_deltaSize];
-	memset(_deltaBuf, 0, _deltaSize);
+	_deltaBuf = allocFrameBuffer(_deltaSize, true);
+
+	// The delta buffers are row-major. This is less clear cut than for
+	// codec 47: at 640x480 they take 1.8MB, more than many L2 caches hold.
+	// An 8x8 block-major layout reads 4.3 cache lines per motion copy
+	// instead of 9.2. With a 2MB L2 the copies were still about 2.5x slower
+	// that way, before putting the frame back into rows. Run
+	// "--benchmark layout" to check a machine with a smaller L2.
 	_deltaBufs[0] = _deltaBuf;
 	_deltaBufs[1] = _deltaBuf + _frameSize;
 	_curBuf = _deltaBuf + _frameSize * 2;
+	_outputBuf = _curBuf;
+
+	// Use a fixed-pitch block decoder for the common frame widths
+	switch (_width) {
+	case 320:
+		_decode2 = &Blocky16::decode2<320 * 2>;
+		break;
+	case 384:
+		_decode2 = &Blocky16::decode2<384 * 2>;
+		break;
+	case 640:
+		_decode2 = &Blocky16::decode2<640 * 2>;
+		break;
+	default:
+		_decode2 = &Blocky16::decode2<0>;
+		break;
+	}
 }
 
 Blocky16::~Blocky16() {
 	_lastTableWidth = -1;
 	if (_deltaBuf) {
-		delete[] _deltaBuf;
+		freeFrameBuffer(_deltaBuf);
 		_deltaSize = 0;
 		_deltaBuf = 0;
 		_deltaBufs[0] = 0;
@@ -639,65 +672,153 @@ Blocky16::~Blocky16() {
 	}
 }
 
-byte Blocky16::bompDecode() {
-	byte code, result;
-	const byte *src;
-
-	if (_bompLeft == 2) {
-		src = _bompSrc;
-		_bompNum = (*src >> 1) + 1;
-		code = *(src++) & 1;
-		_bompSrc = src;
-		if (code != 0) {
-			_bompLeft = 1;
-			_bompColor = *src++;
-			_bompSrc = src;
+bool Blocky16::isInDeltaBuf(int32 offset, int size) const {
+	// size is in pixels
+	return offset >= 0 && offset + (size - 1) * _width * 2 + size * 2 <= _deltaSize;
+}
+
+int Blocky16::checkBlock(const byte *src, const byte *end, int32 pos, int size, bool &safe) const {
+	// Mirrors level1/level2/level3: returns the number of bytes the block
+	// at pos uses, or -1 if the data ends first. Clears safe if it would
+	// copy from outside the delta buffers.
+	const byte *start = src;
+
+	if (src >= end)
+		return -1;
+
+	byte code = *src++;
+	int used = 0;
+
+	if (code <= 0xF5) {
+		int32 offset;
+
+		if (code == 0xF5) {
+			if (end - src < 2)
+				return -1;
+
+			offset = (int16)READ_LE_UINT16(src) * 2;
+			src += 2;
 		} else {
-			_bompLeft = 0;
+			offset = _table[code] * 2;
 		}
-	} else {
-		src = _bompSrc;
-	}
-	if (_bompLeft != 0) {
-		if (_bompLeft - 1 == 0) {
-			result = _bompColor;
-		} else {
-			result = 255;
+
+		if (!isInDeltaBuf(_deltaBufs[1] - _deltaBuf + pos + offset, size))
+			safe = false;
+	} else if (code == 0xF6) {
+		if (!isInDeltaBuf(_deltaBufs[0] - _deltaBuf + pos, size))
+			safe = false;
+	} else if (size == 2) {
+		if (code == 0xFF || code == 0xF8)
+			used = 8;
+		else if (code == 0xF7)
+			used = 4;
+		else if (code == 0xFE)
+			used = 2;
+		else if (code == 0xFD)
+			used = 1;
+	} else if (code == 0xFF) {
+		int half = size / 2;
+		const int32 offsets[4] = { 0, half * 2, _width * 2 * half, _width * 2 * half + half * 2 };
+
+		for (int i = 0; i < 4; i++) {
+			int blockUsed = checkBlock(src, end, pos + offsets[i], half, safe);
+
+			if (blockUsed < 0)
+				return -1;
+
+			src += blockUsed;
 		}
-	} else {
-		result = *(src++);
-		_bompSrc = src;
+	} else if (code == 0xF7) {
+		used = 3;
+	} else if (code == 0xF8) {
+		used = 5;
+	} else if (code == 0xFE) {
+		used = 2;
+	} else if (code == 0xFD) {
+		used = 1;
 	}
 
-	_bompNum--;
-	if (_bompNum == 0) {
-		_bompLeft = 2;
-	}
+	if (end - src < used)
+		return -1;
 
-	return result;
+	return src + used - start;
 }
 
-void Blocky16::bompInit(const byte *src) {
-	_bompLeft = 2;
-	_bompSrc = src;
+bool Blocky16::validate(const byte *src, uint32 size) const {
+	const byte *end = src + size;
+	const byte *gfxData = src + kHeaderSize;
+
+	switch (src[18]) {
+	case 0:
+		return end - gfxData >= _frameSize;
+	case 2: {
+		int32 pos = 0;
+
+		for (int y = 0; y < _height; y += 8) {
+			for (int x = 0; x < _width; x += 8) {
+				bool safe = isInDeltaBuf(_curBuf - _deltaBuf + pos, 8);
+				int used = checkBlock(gfxData, end, pos, 8, safe);
+
+				if (used < 0 || !safe)
+					return false;
+
+				gfxData += used;
+				pos += 16;
+			}
+
+			pos += _width * 2 * 7;
+		}
+
+		return true;
+		}
+	case 5: {
+		int32 len = READ_LE_UINT32(src + 36) & ~1;
+		return len <= _frameSize && bompGetDecodableLength(gfxData, end, len) == len;
+		}
+	case 6:
+		return end - gfxData >= _frameSize / 2;
+	case 8:
+		return bompGetDecodableLength(gfxData, end, _frameSize / 2) == _frameSize / 2;
+	}
+
+	return true;
 }
 
-void Blocky16::bompDecodeMain(byte *dst, const byte *src, int size) {
-	size /= 2;
-	bompInit(src);
-	while (size--) {
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-		*(dst + 1) = bompDecode();
-		*(dst + 0) = bompDecode();
-#else
-		*(dst + 0) = bompDecode();
-		*(dst + 1) = bompDecode();
-#endif
-		dst += 2;
+void Blocky16::decode2Checked(byte *dst, const byte *src, const byte *end, const byte *param_ptr, const byte *param6_7_ptr) {
+	// Check each block right before decoding it. Blocks that would touch
+	// memory outside the delta buffers are skipped, and decoding stops
+	// when the data runs out.
+	_paramPtr = param_ptr - 0xf9 - 0xf9;
+	_param6_7Ptr = param6_7_ptr;
+	_d_pitch = _width * 2;
+
+	int32 pos = 0;
+
+	for (int y = 0; y < _height; y += 8) {
+		for (int x = 0; x < _width; x += 8) {
+			bool safe = isInDeltaBuf(dst - _deltaBuf + pos, 8);
+			int used = checkBlock(src, end, pos, 8, safe);
+
+			if (used < 0)
+				return;
+
+			if (safe) {
+				_d_src = src;
+				level1<0>(dst + pos);
+			}
+
+			src += used;
+			pos += 16;
+		}
+
+		pos += _width * 2 * 7;
 	}
 }
 
-void Blocky16::decode(byte *dst, const byte *src) {
+void Blocky16::decode(byte *dst, const byte *src, uint32 size) {
+	if (size < kHeaderSize)
+		return;
+
 	_offset1 = ((_deltaBufs[1] - _curBuf) / 2) * 2;
 	_offset2 = ((_deltaBufs[0] - _curBuf) / 2) * 2;
 
@@ -724,17 +845,24 @@ void Blocky16::decode(byte *dst, const byte *src) {
 		_prevSeqNb = -1;
 	}
 
+	const byte *end = src + size;
+	bool valid = validate(src, size);
+
 	switch(src[18]) {
-	case 0:
-		for (int i = 0; i < _width * _height; i++)
+	case 0: {
+		int count = valid ? _width * _height : MIN<int32>(_width * _height, (end - gfx_data) / 2);
+		for (int i = 0; i < count; i++)
 			((uint16 *)_curBuf)[i] = READ_LE_UINT16(gfx_data + i * 2);
-		break;
+		} break;
 	case 1:
 		fprintf(stderr, "Blocky16: Unimplemented proc 1\n");
 		return;
 	case 2:
 		if (seq_nb == _prevSeqNb + 1) {
-			decode2(_curBuf, gfx_data, _width, _height, src + 24, src + 40);
+			if (valid)
+				(this->*_decode2)(_curBuf, gfx_data, _width, _height, src + 24, src + 40);
+			else
+				decode2Checked(_curBuf, gfx_data, end, src + 24, src + 40);
 		}
 
 		break;
@@ -744,11 +872,20 @@ void Blocky16::decode(byte *dst, const byte *src) {
 	case 4:
 		memcpy(_curBuf, _deltaBufs[0], _frameSize);
 		break;
-	case 5:
-		bompDecodeMain(_curBuf, gfx_data, READ_LE_UINT32(src + 36));
-		break;
+	case 5: {
+		int32 len = READ_LE_UINT32(src + 36);
+
+		if (!valid)
+			len = bompGetDecodableLength(gfx_data, end, MIN<int32>(len & ~1, _frameSize));
+
+		bompDecodeLine(_curBuf, gfx_data, end, len & ~1);
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+		for (int32 i = 0; i < (len & ~1); i += 2)
+			SWAP(_curBuf[i], _curBuf[i + 1]);
+#endif
+		} break;
 	case 6: {
-		int count = _frameSize / 2;
+		int count = valid ? _frameSize / 2 : MIN<int32>(_frameSize / 2, end - gfx_data);
 		uint16 *ptr = (uint16 *)_curBuf;
 		while (count--) {
 			int offset = *gfx_data++ * 2;
@@ -760,18 +897,16 @@ void Blocky16::decode(byte *dst, const byte *src) {
 		fprintf(stderr, "Blocky16: Unimplemented proc 7\n");
 		return;
 	case 8: {
-		bompInit(gfx_data);
-		int count = _frameSize / 2;
-		uint16 *ptr = (uint16 *)_curBuf;
-		while (count--) {
-			int offset = bompDecode() * 2;
-			*(uint16 *)ptr++ = READ_LE_UINT16(src + 40 + offset);
-		};
+		int count = valid ? _frameSize / 2 : bompGetDecodableLength(gfx_data, end, _frameSize / 2);
+		bompDecodeLine16((uint16 *)_curBuf, gfx_data, count, src + 40);
 		break;
 	}
 	}
 
-	memcpy(dst, _curBuf, _frameSize);
+	_outputBuf = _curBuf;
+
+	if (dst)
+		memcpy(dst, _curBuf, _frameSize);
 
 	if (seq_nb == _prevSeqNb + 1) {
 		byte *tmp_ptr = 0;
@@ -789,3 +924,44 @@ void Blocky16::decode(byte *dst, const byte *src) {
 
 	_prevSeqNb = seq_nb;
 }
+
+void Blocky16::copyFrame(byte *dst) const {
+	memcpy(dst, _outputBuf, _frameSize);
+}
+
+// The state is this header, followed by the whole delta buffer allocation
+struct Blocky16State {
+	int32 prevSeqNb;
+	byte bufIndex[4];
+};
+
+uint32 Blocky16::getStateSize() const {
+	return sizeof(Blocky16State) + _deltaSize;
+}
+
+void Blocky16::saveState(byte *dst) const {
+	Blocky16State state;
+	state.prevSeqNb = _prevSeqNb;
+	state.bufIndex[0] = (_deltaBufs[0] - _deltaBuf) / _frameSize;
+	state.bufIndex[1] = (_deltaBufs[1] - _deltaBuf) / _frameSize;
+	state.bufIndex[2] = (_curBuf - _deltaBuf) / _frameSize;
+	state.bufIndex[3] = (_outputBuf - _deltaBuf) / _frameSize;
+
+	memcpy(dst, &state, sizeof(state));
+	memcpy(dst + sizeof(state), _deltaBuf, _deltaSize);
+}
+
+void Blocky16::loadState(const byte *src) {
+	Blocky16State state;
+	memcpy(&state, src, sizeof(state));
+
+	_prevSeqNb = state.prevSeqNb;
+	_deltaBufs[0] = _deltaBuf + state.bufIndex[0] * _frameSize;
+	_deltaBufs[1] = _deltaBuf + state.bufIndex[1] * _frameSize;
+	_curBuf = _deltaBuf + state.bufIndex[2] * _frameSize;
+	_outputBuf = _deltaBuf + state.bufIndex[3] * _frameSize;
+	memcpy(_deltaBuf, src + sizeof(state), _deltaSize);
+
+	// Normally built by the first frame, which we may never have seen
+	makeTables47(_width);
+}
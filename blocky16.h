@@ -31,13 +31,28 @@ class Blocky16 {
 public:
 	Blocky16(uint width, uint height);
 	~Blocky16();
-	void decode(byte *dst, const byte *src);
+	// dst may be 0 if the frame won't be shown, which skips everything
+	// that's only needed for output
+	void decode(byte *dst, const byte *src, uint32 size);
+
+	/** Copy the last decoded frame, for when decode() was given no dst */
+	void copyFrame(byte *dst) const;
+
+	int getWidth() const { return _width; }
+	int getHeight() const { return _height; }
+
+	// State snapshots, so decoding can resume from an earlier frame. A
+	// state can only be loaded into a decoder with the same frame size.
+	uint32 getStateSize() const;
+	void saveState(byte *dst) const;
+	void loadState(const byte *src);
 
 private:
 	int32 _deltaSize;
 	byte *_deltaBufs[2];
 	byte *_deltaBuf;
 	byte *_curBuf;
+	byte *_outputBuf;
 	int32 _prevSeqNb;
 	int _lastTableWidth;
 	const byte *_d_src, *_paramPtr, *_param6_7Ptr;
@@ -51,19 +66,26 @@ private:
 
 	void makeTablesInterpolation(int param);
 	void makeTables47(int width);
-	void level1(byte *d_dst);
-	void level2(byte *d_dst);
-	void level3(byte *d_dst);
-	void decode2(byte *dst, const byte *src, int width, int height, const byte *param_ptr, const byte *param6_7_ptr);
 
-	// BOMP
-	void bompDecodeMain(byte *dst, const byte *src, int size);
-	void bompInit(const byte *src);
-	byte bompDecode();
-	int _bompLeft;
-	int _bompNum;
-	int _bompColor;
-	const byte *_bompSrc;
+	// The block functions are instantiated with a compile-time pitch (in
+	// bytes) for the common frame widths; a PITCH of 0 means use _d_pitch.
+	template<int PITCH> void level1(byte *d_dst);
+	template<int PITCH> void level2(byte *d_dst);
+	template<int PITCH> void level3(byte *d_dst);
+	template<int PITCH> void decode2(byte *dst, const byte *src, int width, int height, const byte *param_ptr, const byte *param6_7_ptr);
+	typedef void (Blocky16::*Decode2Proc)(byte *dst, const byte *src, int width, int height, const byte *param_ptr, const byte *param6_7_ptr);
+	Decode2Proc _decode2;
+
+	// Chunks are checked once up front so that the block functions can run
+	// without any bounds checks. Chunks that fail go through decode2Checked.
+	enum {
+		kHeaderSize = 560
+	};
+
+	bool validate(const byte *src, uint32 size) const;
+	int checkBlock(const byte *src, const byte *end, int32 pos, int size, bool &safe) const;
+	bool isInDeltaBuf(int32 offset, int size) const;
+	void decode2Checked(byte *dst, const byte *src, const byte *end, const byte *param_ptr, const byte *param6_7_ptr);
 };
 
 #endif
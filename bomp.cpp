@@ -0,0 +1,142 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include "bomp.h"
+#include "util.h"
+
+int bompGetDecodableLength(const byte *src, const byte *end, int len) {
+	int pos = 0;
+
+	while (pos < len) {
+		if (src >= end)
+			break;
+
+		byte code = *src++;
+		int num = (code >> 1) + 1;
+
+		if (num > len - pos)
+			num = len - pos;
+
+		if (code & 1) {
+			if (src >= end)
+				break;
+
+			src++;
+		} else {
+			if (num > end - src)
+				return pos + (end - src);
+
+			src += num;
+		}
+
+		pos += num;
+	}
+
+	return pos;
+}
+
+// Runs are at most 128 pixels long, so instead of handing each one to a
+// variable-length memset/memcpy they're written in fixed 16 byte chunks,
+// which the compiler turns into single vector stores. Anything written past
+// the end of a run is overwritten by the next one, so that's only done when
+// the chunks still end within len (and, for literals, within the data).
+enum {
+	kChunkSize = 16
+};
+
+static inline int roundUpToChunk(int num) {
+	return (num + kChunkSize - 1) & ~(kChunkSize - 1);
+}
+
+void bompDecodeLine(byte *dst, const byte *src, const byte *end, int len) {
+	while (len > 0) {
+		byte code = *src++;
+		int num = (code >> 1) + 1;
+
+		if (num > len)
+			num = len;
+
+		int chunked = roundUpToChunk(num);
+
+		if (code & 1) {
+			byte color = *src++;
+
+			if (chunked <= len) {
+				for (int i = 0; i < num; i += kChunkSize)
+					memset(dst + i, color, kChunkSize);
+			} else {
+				memset(dst, color, num);
+			}
+		} else {
+			if (chunked <= len && chunked <= end - src) {
+				for (int i = 0; i < num; i += kChunkSize)
+					memcpy(dst + i, src + i, kChunkSize);
+			} else {
+				memcpy(dst, src, num);
+			}
+
+			src += num;
+		}
+
+		dst += num;
+		len -= num;
+	}
+}
+
+void bompDecodeLine16(uint16 *dst, const byte *src, int len, const byte *table) {
+	// Convert the table once so the literal loop is a plain indexed load
+	uint16 lut[256];
+	for (int i = 0; i < 256; i++)
+		lut[i] = READ_LE_UINT16(table + i * 2);
+
+	const int chunkPixels = kChunkSize / 2;
+
+	while (len > 0) {
+		byte code = *src++;
+		int num = (code >> 1) + 1;
+
+		if (num > len)
+			num = len;
+
+		if (code & 1) {
+			uint16 color = lut[*src++];
+
+			if (((num + chunkPixels - 1) & ~(chunkPixels - 1)) <= len) {
+				for (int i = 0; i < num; i += chunkPixels)
+					for (int j = 0; j < chunkPixels; j++)
+						dst[i + j] = color;
+			} else {
+				for (int i = 0; i < num; i++)
+					dst[i] = color;
+			}
+		} else {
+			for (int i = 0; i < num; i++)
+				dst[i] = lut[src[i]];
+
+			src += num;
+		}
+
+		dst += num;
+		len -= num;
+	}
+}
@@ -0,0 +1,47 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef BOMP_H
+#define BOMP_H
+
+#include "types.h"
+
+/**
+ * Walk BOMP RLE data that should produce len pixels and return how many
+ * of them can be decoded without reading past end.
+ */
+int bompGetDecodableLength(const byte *src, const byte *end, int len);
+
+/**
+ * Decode len pixels of BOMP RLE data into dst. The data must hold at least
+ * len pixels (see bompGetDecodableLength); end is only used to tell how far
+ * ahead src can safely be read.
+ */
+void bompDecodeLine(byte *dst, const byte *src, const byte *end, int len);
+
+/**
+ * Same as bompDecodeLine, but each decoded byte is looked up in a table of
+ * 256 little-endian 16-bit values and the result written to dst.
+ */
+void bompDecodeLine16(uint16 *dst, const byte *src, int len, const byte *table);
+
+#endif
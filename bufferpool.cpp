@@ -0,0 +1,80 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include "bufferpool.h"
+
+BufferPool::BufferPool() {
+	_mutex = SDL_CreateMutex();
+}
+
+BufferPool::~BufferPool() {
+	for (uint i = 0; i < _free.size(); i++)
+		delete[] (_free[i] - kHeaderSize);
+
+	SDL_DestroyMutex(_mutex);
+}
+
+uint32 BufferPool::getCapacity(const byte *buffer) {
+	uint32 capacity;
+	memcpy(&capacity, buffer - kHeaderSize, sizeof(capacity));
+	return capacity;
+}
+
+byte *BufferPool::acquire(uint32 size) {
+	SDL_LockMutex(_mutex);
+
+	// Chunks in a video are mostly the same size, so the newest free
+	// buffer that's big enough is usually the right one
+	for (int i = _free.size() - 1; i >= 0; i--) {
+		if (getCapacity(_free[i]) >= size) {
+			byte *buffer = _free[i];
+			_free.erase(_free.begin() + i);
+			SDL_UnlockMutex(_mutex);
+			return buffer;
+		}
+	}
+
+	SDL_UnlockMutex(_mutex);
+
+	byte *buffer = new byte[size + kHeaderSize] + kHeaderSize;
+	memcpy(buffer - kHeaderSize, &size, sizeof(size));
+	return buffer;
+}
+
+void BufferPool::release(byte *buffer) {
+	if (!buffer)
+		return;
+
+	bool kept = false;
+	SDL_LockMutex(_mutex);
+
+	if (_free.size() < kMaxFreeBuffers) {
+		_free.push_back(buffer);
+		kept = true;
+	}
+
+	SDL_UnlockMutex(_mutex);
+
+	if (!kept)
+		delete[] (buffer - kHeaderSize);
+}
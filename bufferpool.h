@@ -0,0 +1,62 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <SDL_thread.h>
+#include <vector>
+#include "types.h"
+
+/**
+ * Recycles the sample buffers handed to audio streams, so decoding a
+ * chunk doesn't allocate. Buffers can be released from any thread, such
+ * as the audio thread when it's done with a stream.
+ */
+class BufferPool {
+public:
+	BufferPool();
+	~BufferPool();
+
+	/** Get a buffer of at least size bytes */
+	byte *acquire(uint32 size);
+
+	/** Give back a buffer from acquire() */
+	void release(byte *buffer);
+
+private:
+	enum {
+		// Buffers kept around beyond this are freed instead
+		kMaxFreeBuffers = 16,
+
+		// Room in front of each buffer for its size, keeping the data
+		// 16-byte aligned
+		kHeaderSize = 16
+	};
+
+	static uint32 getCapacity(const byte *buffer);
+
+	SDL_mutex *_mutex;
+	std::vector<byte *> _free;
+};
+
+#endif
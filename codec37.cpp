@@ -24,7 +24,9 @@
 
 #include <assert.h>
 #include <string.h>
+#include "bomp.h"
 #include "codec37.h"
+#include "framebuffer.h"
 #include "util.h"
 
 Codec37Decoder::Codec37Decoder(int width, int height) {
@@ -33,8 +35,7 @@ Codec37Decoder::Codec37Decoder(int width, int height) {
 	_frameSize = _width * _height;
 	_deltaSize = _frameSize * 3 + 0x13600;
 
-	_deltaBuf = new byte[_deltaSize];
-	memset(_deltaBuf, 0, _deltaSize);
+	_deltaBuf = allocFrameBuffer(_deltaSize);
 
 	_deltaBufs[0] = _deltaBuf + 0x4D80;
 	_deltaBufs[1] = _deltaBuf + 0xE880 + _frameSize;
@@ -45,6 +46,22 @@ Codec37Decoder::Codec37Decoder(int width, int height) {
 	_prevSeqNb = 0;
 	_tableLastPitch = -1;
 	_tableLastIndex = -1;
+
+	// Use fixed-pitch block procs for the common frame widths
+	switch ((_width + 3) / 4 * 4) {
+	case 320:
+		selectProcs<320>();
+		break;
+	case 384:
+		selectProcs<384>();
+		break;
+	case 640:
+		selectProcs<640>();
+		break;
+	default:
+		selectProcs<0>();
+		break;
+	}
 }
 
 Codec37Decoder::~Codec37Decoder() {
@@ -56,7 +73,7 @@ Codec37Decoder::~Codec37Decoder() {
 	}
 
 	if (_deltaBuf) {
-		delete[] _deltaBuf;
+		freeFrameBuffer(_deltaBuf);
 		_deltaSize = 0;
 		_deltaBuf = 0;
 		_deltaBufs[0] = 0;
@@ -290,7 +307,9 @@ void Codec37Decoder::makeTable(int pitch, int index) {
 		dst += 4; \
 	} while (0)
 
-void Codec37Decoder::proc1(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int pitch, int16 *offset_table) {
+template<int PITCH>
+void Codec37Decoder::proc1(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int runtimePitch, int16 *offset_table) {
+	const int pitch = PITCH ? PITCH : runtimePitch;
 	byte code;
 	bool filling, skipCode;
 	int32 len;
@@ -355,7 +374,9 @@ void Codec37Decoder::proc1(byte *dst, const byte *src, int32 nextOffs, int bw, i
 	}
 }
 
-void Codec37Decoder::proc3WithFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int pitch, int16 *offset_table) {
+template<int PITCH>
+void Codec37Decoder::proc3WithFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int runtimePitch, int16 *offset_table) {
+	const int pitch = PITCH ? PITCH : runtimePitch;
 	do {
 		int32 i = bw;
 		do {
@@ -375,7 +396,9 @@ void Codec37Decoder::proc3WithFDFE(byte *dst, const byte *src, int32 nextOffs, i
 	} while (--bh);
 }
 
-void Codec37Decoder::proc3WithoutFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int pitch, int16 *offset_table) {
+template<int PITCH>
+void Codec37Decoder::proc3WithoutFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int runtimePitch, int16 *offset_table) {
+	const int pitch = PITCH ? PITCH : runtimePitch;
 	do {
 		int32 i = bw;
 		do {
@@ -391,7 +414,9 @@ void Codec37Decoder::proc3WithoutFDFE(byte *dst, const byte *src, int32 nextOffs
 	} while (--bh);
 }
 
-void Codec37Decoder::proc4WithFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int pitch, int16 *offset_table) {
+template<int PITCH>
+void Codec37Decoder::proc4WithFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int runtimePitch, int16 *offset_table) {
+	const int pitch = PITCH ? PITCH : runtimePitch;
 	do {
 		int32 i = bw;
 		do {
@@ -427,7 +452,9 @@ void Codec37Decoder::proc4WithFDFE(byte *dst, const byte *src, int32 nextOffs, i
 	} while (--bh);
 }
 
-void Codec37Decoder::proc4WithoutFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int pitch, int16 *offset_table) {
+template<int PITCH>
+void Codec37Decoder::proc4WithoutFDFE(byte *dst, const byte *src, int32 nextOffs, int bw, int bh, int runtimePitch, int16 *offset_table) {
+	const int pitch = PITCH ? PITCH : runtimePitch;
 	do {
 		int32 i = bw;
 		do {
@@ -459,7 +486,143 @@ void Codec37Decoder::proc4WithoutFDFE(byte *dst, const byte *src, int32 nextOffs
 	} while (--bh);
 }
 
-void Codec37Decoder::decode(byte *dst, const byte *src) {
+template<int PITCH>
+void Codec37Decoder::selectProcs() {
+	_proc1 = &Codec37Decoder::proc1<PITCH>;
+	_proc3WithFDFE = &Codec37Decoder::proc3WithFDFE<PITCH>;
+	_proc3WithoutFDFE = &Codec37Decoder::proc3WithoutFDFE<PITCH>;
+	_proc4WithFDFE = &Codec37Decoder::proc4WithFDFE<PITCH>;
+	_proc4WithoutFDFE = &Codec37Decoder::proc4WithoutFDFE<PITCH>;
+}
+
+bool Codec37Decoder::isInDeltaBuf(int32 offset, int pitch) const {
+	// Does a 4x4 block at offset fit in the delta buffer?
+	return offset >= 0 && offset + pitch * 3 + 4 <= _deltaSize;
+}
+
+// Bail out with the rows that were fine so far if the data ends early
+#define NEED_BYTES(n) \
+	do { \
+		if (end - src < (n)) \
+			return safeBlocks / bw; \
+	} while (0)
+
+int Codec37Decoder::checkBlockRows(const byte *src, const byte *end, int type, bool fdfe, int32 nextOffs, int bw, int bh, int pitch) const {
+	// This follows the same steps as the procs, but only tracks where the
+	// data and the block copies go. A run of blocks from proc4 can end part
+	// way into a row; the procs stop cleanly after such a run as long as it
+	// doesn't go past the next row, so any point between codes is fine to
+	// stop at.
+	int32 base = _deltaBufs[_curTable] - _deltaBuf;
+	int total = bw * bh;
+	int k = 0, safeBlocks = 0;
+
+	// proc1 state
+	bool filling = false;
+	int32 len = -1;
+	byte code = 0;
+
+	while (k < total) {
+		int32 pos = base + (k / bw) * pitch * 4 + (k % bw) * 4;
+
+		if (!isInDeltaBuf(pos, pitch))
+			break;
+
+		if (type == 1) {
+			bool skipCode = true;
+
+			if (len < 0) {
+				NEED_BYTES(1);
+				filling = (*src & 1) == 1;
+				len = *src++ >> 1;
+				skipCode = false;
+			}
+
+			if (!filling || !skipCode) {
+				NEED_BYTES(1);
+				code = *src++;
+
+				if (code == 0xFF) {
+					--len;
+
+					for (int p = 0; p < 16; p++) {
+						if (len < 0) {
+							NEED_BYTES(1);
+							filling = (*src & 1) == 1;
+							len = *src++ >> 1;
+
+							if (filling) {
+								NEED_BYTES(1);
+								code = *src++;
+							}
+						}
+
+						if (!filling) {
+							NEED_BYTES(1);
+							src++;
+						}
+
+						--len;
+					}
+
+					safeBlocks = ++k;
+					continue;
+				}
+			}
+
+			// A fill can leave 0xFF as the code, which is past the end of
+			// the offset table
+			if (code == 0xFF || !isInDeltaBuf(pos + _offsetTable[code] + nextOffs, pitch))
+				break;
+
+			--len;
+		} else {
+			NEED_BYTES(1);
+			code = *src++;
+
+			if (code == 0xFF) {
+				NEED_BYTES(16);
+				src += 16;
+			} else if (fdfe && code == 0xFE) {
+				NEED_BYTES(4);
+				src += 4;
+			} else if (fdfe && code == 0xFD) {
+				NEED_BYTES(1);
+				src++;
+			} else if (type == 4 && code == 0x00) {
+				NEED_BYTES(1);
+				int32 length = *src++ + 1;
+
+				if (k + length > total)
+					break;
+
+				for (int32 l = 0; l < length; l++) {
+					int32 runPos = base + ((k + l) / bw) * pitch * 4 + ((k + l) % bw) * 4;
+
+					if (!isInDeltaBuf(runPos, pitch) || !isInDeltaBuf(runPos + nextOffs, pitch))
+						return safeBlocks / bw;
+				}
+
+				k += length;
+				safeBlocks = k;
+				continue;
+			} else if (!isInDeltaBuf(pos + _offsetTable[code] + nextOffs, pitch)) {
+				break;
+			}
+		}
+
+		safeBlocks = ++k;
+	}
+
+	return safeBlocks / bw;
+}
+
+#undef NEED_BYTES
+
+void Codec37Decoder::decode(byte *dst, const byte *src, uint32 size) {
+	if (size < 16)
+		return;
+
 	int32 bw = (_width + 3) / 4, bh = (_height + 3) / 4;
 	int32 pitch = bw * 4;
 
@@ -469,8 +632,13 @@ void Codec37Decoder::decode(byte *dst, const byte *src) {
 	makeTable(pitch, src[1]);
 	int32 tmp;
 
+	const byte *end = src + size;
+	int32 bufLeft = (_deltaBuf + _deltaSize) - _deltaBufs[_curTable];
+	int rows;
+
 	switch (src[0]) {
 	case 0:
+		decodedSize = CLIP<int32>(decodedSize, 0, MIN<int32>(size - 16, bufLeft));
 		if ((_deltaBufs[_curTable] - _deltaBuf) > 0) {
 			memset(_deltaBuf, 0, _deltaBufs[_curTable] - _deltaBuf);
 		}
@@ -484,11 +652,16 @@ void Codec37Decoder::decode(byte *dst, const byte *src) {
 		if ((seq & 1) || !(maskFlags & 1)) {
 			_curTable ^= 1;
 		}
-		proc1(_deltaBufs[_curTable], src + 16, _deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable],
-										bw, bh, pitch, _offsetTable);
+		rows = checkBlockRows(src + 16, end, 1, false, _deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh, pitch);
+		if (rows > 0) {
+			(this->*_proc1)(_deltaBufs[_curTable], src + 16, _deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable],
+											bw, rows, pitch, _offsetTable);
+		}
 		break;
 	case 2:
-		bompDecodeLine(_deltaBufs[_curTable], src + 16, decodedSize);
+		decodedSize = CLIP<int32>(decodedSize, 0, bufLeft);
+		decodedSize = bompGetDecodableLength(src + 16, end, decodedSize);
+		bompDecodeLine(_deltaBufs[_curTable], src + 16, end, decodedSize);
 		if ((_deltaBufs[_curTable] - _deltaBuf) > 0) {
 			memset(_deltaBuf, 0, _deltaBufs[_curTable] - _deltaBuf);
 		}
@@ -502,13 +675,17 @@ void Codec37Decoder::decode(byte *dst, const byte *src) {
 			_curTable ^= 1;
 		}
 
+		rows = checkBlockRows(src + 16, end, 3, (maskFlags & 4) != 0, _deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh, pitch);
+		if (rows == 0)
+			break;
+
 		if ((maskFlags & 4) != 0) {
-			proc3WithFDFE(_deltaBufs[_curTable], src + 16,
-										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh,
+			(this->*_proc3WithFDFE)(_deltaBufs[_curTable], src + 16,
+										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, rows,
 										pitch, _offsetTable);
 		} else {
-			proc3WithoutFDFE(_deltaBufs[_curTable], src + 16,
-										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh,
+			(this->*_proc3WithoutFDFE)(_deltaBufs[_curTable], src + 16,
+										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, rows,
 										pitch, _offsetTable);
 		}
 		break;
@@ -517,13 +694,17 @@ void Codec37Decoder::decode(byte *dst, const byte *src) {
 			_curTable ^= 1;
 		}
 
+		rows = checkBlockRows(src + 16, end, 4, (maskFlags & 4) != 0, _deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh, pitch);
+		if (rows == 0)
+			break;
+
 		if ((maskFlags & 4) != 0) {
-			proc4WithFDFE(_deltaBufs[_curTable], src + 16,
-										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh,
+			(this->*_proc4WithFDFE)(_deltaBufs[_curTable], src + 16,
+										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, rows,
 										pitch, _offsetTable);
 		} else {
-			proc4WithoutFDFE(_deltaBufs[_curTable], src + 16,
-										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, bh,
+			(this->*_proc4WithoutFDFE)(_deltaBufs[_curTable], src + 16,
+										_deltaBufs[_curTable ^ 1] - _deltaBufs[_curTable], bw, rows,
 										pitch, _offsetTable);
 		}
 		break;
@@ -532,27 +713,41 @@ void Codec37Decoder::decode(byte *dst, const byte *src) {
 	}
 	_prevSeqNb = seq;
 
+	if (dst)
+		memcpy(dst, _deltaBufs[_curTable], _frameSize);
+}
+
+void Codec37Decoder::copyFrame(byte *dst) const {
 	memcpy(dst, _deltaBufs[_curTable], _frameSize);
 }
 
-void Codec37Decoder::bompDecodeLine(byte *dst, const byte *src, int len) {
-	while (len > 0) {
-		byte code = *src++;
-		byte num = (code >> 1) + 1;
+// The state is this header, followed by the whole delta buffer allocation.
+// Frame types 0 and 2 clear everything around the current buffer, so
+// there's no smaller part of it that could be saved instead.
+struct Codec37State {
+	int32 curTable;
+	uint16 prevSeqNb;
+};
 
-		if (num > len)
-			num = len;
+uint32 Codec37Decoder::getStateSize() const {
+	return sizeof(Codec37State) + _deltaSize;
+}
 
-		len -= num;
+void Codec37Decoder::saveState(byte *dst) const {
+	Codec37State state;
+	state.curTable = _curTable;
+	state.prevSeqNb = _prevSeqNb;
 
-		if (code & 1) {
-			byte color = *src++;
-			memset(dst, color, num);
-		} else {
-			memcpy(dst, src, num);
-			src += num;
-		}
+	memcpy(dst, &state, sizeof(state));
+	memcpy(dst + sizeof(state), _deltaBuf, _deltaSize);
+}
 
-		dst += num;
-	}
+void Codec37Decoder::loadState(const byte *src) {
+	Codec37State state;
+	memcpy(&state, src, sizeof(state));
+
+	_curTable = state.curTable;
+	_prevSeqNb = state.prevSeqNb;
+	memcpy(_deltaBuf, src + sizeof(state), _deltaSize);
 }
+
@@ -32,16 +32,43 @@ public:
 	Codec37Decoder(int width, int height);
 	~Codec37Decoder();
 
-	void decode(byte *dst, const byte *src);
+	// dst may be 0 if the frame won't be shown, which skips everything
+	// that's only needed for output
+	void decode(byte *dst, const byte *src, uint32 size);
+
+	/** Copy the last decoded frame, for when decode() was given no dst */
+	void copyFrame(byte *dst) const;
+
+	int getWidth() const { return _width; }
+	int getHeight() const { return _height; }
+
+	// State snapshots, so decoding can resume from an earlier frame. A
+	// state can only be loaded into a decoder with the same frame size.
+	uint32 getStateSize() const;
+	void saveState(byte *dst) const;
+	void loadState(const byte *src);
 
 private:
 	void makeTable(int, int);
-	void proc1(byte *dst, const byte *src, int32, int, int, int, int16 *);
-	void proc3WithFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
-	void proc3WithoutFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
-	void proc4WithFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
-	void proc4WithoutFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
-	void bompDecodeLine(byte *dst, const byte *src, int len);
+
+	// The block procs are instantiated with a compile-time pitch for the
+	// common frame widths; a PITCH of 0 means use the pitch argument.
+	template<int PITCH> void proc1(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	template<int PITCH> void proc3WithFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	template<int PITCH> void proc3WithoutFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	template<int PITCH> void proc4WithFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	template<int PITCH> void proc4WithoutFDFE(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	template<int PITCH> void selectProcs();
+
+	// The procs run without bounds checks, so the block data is walked
+	// first to find how many rows of blocks they can safely decode.
+	int checkBlockRows(const byte *src, const byte *end, int type, bool fdfe, int32 nextOffs, int bw, int bh, int pitch) const;
+	bool isInDeltaBuf(int32 offset, int pitch) const;
+
+	typedef void (Codec37Decoder::*BlockProc)(byte *dst, const byte *src, int32, int, int, int, int16 *);
+	BlockProc _proc1;
+	BlockProc _proc3WithFDFE, _proc3WithoutFDFE;
+	BlockProc _proc4WithFDFE, _proc4WithoutFDFE;
 
 	int32 _deltaSize;
 	byte *_deltaBufs[2];
@@ -24,7 +24,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bomp.h"
 #include "codec47.h"
+#include "framebuffer.h"
 #include "util.h"
 
 Codec47Decoder::Codec47Decoder(int width, int height) {
@@ -41,87 +46,158 @@ Codec47Decoder::Codec47Decoder(int width, int height) {
 
 	_frameSize = _width * _height;
 	_deltaSize = _frameSize * 3;
-	_deltaBuf = new byte[_deltaSize];
+	_deltaBuf = allocFrameBuffer(_deltaSize);
+
+	// The delta buffers are row-major. An 8x8 block-major layout would cut
+	// the cache lines a motion copy reads from about 8.6 to 2.8 at 640x480,
+	// but the three buffers are only 900KB and stay in L2. Gathering a moved
+	// block from the blocks it overlaps then costs more than the misses it
+	// saves: about 2.5x slower per frame, before a pass to put the frame
+	// back into rows. See "--benchmark layout".
 	_deltaBufs[0] = _deltaBuf;
 	_deltaBufs[1] = _deltaBuf + _frameSize;
 	_curBuf = _deltaBuf + _frameSize * 2;
+	_outputBuf = _curBuf;
+	_prevOffset = 0;
 	_interTable = 0;
+	_scaleSrc = 0;
+	_scaleDst = 0;
+
+	// Use a fixed-pitch block decoder for the common frame widths
+	switch (_width) {
+	case 320:
+		_decode2 = &Codec47Decoder::decode2<320>;
+		break;
+	case 384:
+		_decode2 = &Codec47Decoder::decode2<384>;
+		break;
+	case 640:
+		_decode2 = &Codec47Decoder::decode2<640>;
+		break;
+	default:
+		_decode2 = &Codec47Decoder::decode2<0>;
+		break;
+	}
 }
 
 Codec47Decoder::~Codec47Decoder() {
 	delete[] _tableBig;
 	delete[] _tableSmall;
-	delete[] _deltaBuf;
-	delete[] _interTable;
+	freeFrameBuffer(_deltaBuf);
+	delete[] _scaleSrc;
 }
 
-bool Codec47Decoder::decode(byte *dst, const byte *src) {
+bool Codec47Decoder::decode(byte *dst, const byte *src, uint32 size) {
 	if (!_tableBig || !_tableSmall || !_deltaBuf)
 		return false;
 
+	if (size < kHeaderSize)
+		return false;
+
 	_offset1 = _deltaBufs[1] - _curBuf;
 	_offset2 = _deltaBufs[0] - _curBuf;
+	_prevOffset = _outputBuf - _curBuf;
+	_dirty.clear();
 
 	int32 seq_nb = READ_LE_UINT16(src + 0);
 
-	const byte *gfxData = src + 26;
+	const byte *gfxData = src + kHeaderSize;
+	const byte *end = src + size;
 
 	if (seq_nb == 0) {
+		// A skipped quarter-size frame that has since become a delta
+		// buffer is about to be reset, so it doesn't need scaling up.
+		// Scaling it afterwards would write over the reset.
+		if (_scaleDst == _deltaBufs[0] || _scaleDst == _deltaBufs[1])
+			_scaleDst = 0;
+
 		makeTables47(_width);
 		memset(_deltaBufs[0], src[12], _frameSize);
 		memset(_deltaBufs[1], src[13], _frameSize);
 		_prevSeqNb = -1;
+		_dirty.addAll();
 	}
 
-	if ((src[4] & 1) != 0) {
-		// Interpolation table present
-		if (!_interTable)
-			_interTable = new byte[65536];
-
-		byte *ptr = _interTable;
+	bool valid = validate(src, size);
 
-		for (int i = 0; i < 256; i++) {
-			byte *ptr1 = ptr + i;
-			byte *ptr2 = ptr + i;
-
-			for (int j = 256 - i; j > 0; j--) {
-				byte pixel = *gfxData++;
-				*ptr2 = pixel;
-				*ptr1++ = pixel;
-				ptr2 += 256;
-			}
+	// Scale up the last skipped quarter-size frame, unless this one
+	// replaces it anyway. It has to use the old interpolation table.
+	if (_scaleDst) {
+		if (_scaleDst == _curBuf && (src[2] == 3 || src[2] == 4 || (src[2] == 1 && valid && (_interTable || (src[4] & 1)))))
+			_scaleDst = 0;
+		else
+			finishScale();
+	}
 
-			ptr += 256;
-		}
+	if ((src[4] & 1) != 0 && end - gfxData >= (int32)InterpolationTable::kPackedSize) {
+		// Interpolation table present
+		_interTable = _interTables.load(gfxData);
+		gfxData += InterpolationTable::kPackedSize;
 	}
 
 	switch (src[2]) {
 	case 0:
 		// Intraframe
-		memcpy(_curBuf, gfxData, _frameSize);
+		memcpy(_curBuf, gfxData, valid ? _frameSize : MIN<int32>(_frameSize, end - gfxData));
+		_dirty.addAll();
 		break;
 	case 1:
 		// Intraframe, 1/4 size
 		// (Outlaws only?)
-		scaleFrame(_curBuf, gfxData);
+		_dirty.addAll();
+
+		if (_interTable && valid) {
+			if (dst) {
+				scaleFrame(_curBuf, gfxData);
+			} else {
+				if (!_scaleSrc)
+					_scaleSrc = new byte[_frameSize / 4];
+
+				memcpy(_scaleSrc, gfxData, _frameSize / 4);
+				_scaleDst = _curBuf;
+			}
+		}
 		break;
 	case 2:
 		if (seq_nb == _prevSeqNb + 1) {
-			decode2(_curBuf, gfxData, _width, _height, src + 8);
+			if (valid) {
+				(this->*_decode2)(_curBuf, gfxData, _width, _height, src + 8);
+			} else {
+				decode2Checked(_curBuf, gfxData, end, src + 8);
+				_dirty.addAll();
+			}
+		} else if (_prevOffset != 0) {
+			_dirty.addAll();
 		}
 		break;
 	case 3:
 		memcpy(_curBuf, _deltaBufs[1], _frameSize);
+
+		if (_prevOffset != _offset1)
+			_dirty.addAll();
 		break;
 	case 4:
 		memcpy(_curBuf, _deltaBufs[0], _frameSize);
+
+		if (_prevOffset != _offset2)
+			_dirty.addAll();
 		break;
-	case 5:
-		bompDecodeLine(_curBuf, gfxData, READ_LE_UINT32(src + 14));
-		break;
+	case 5: {
+		_dirty.addAll();
+
+		int32 len = MIN<int32>(READ_LE_UINT32(src + 14), _frameSize);
+
+		if (!valid)
+			len = bompGetDecodableLength(gfxData, end, len);
+
+		bompDecodeLine(_curBuf, gfxData, end, len);
+		} break;
 	}
 
-	memcpy(dst, _curBuf, _frameSize);
+	_outputBuf = _curBuf;
+
+	if (dst)
+		memcpy(dst, _curBuf, _frameSize);
 
 	if (seq_nb == _prevSeqNb + 1) {
 		if (src[3] == 1) {
@@ -136,6 +212,73 @@ bool Codec47Decoder::decode(byte *dst, const byte *src) {
 	return true;
 }
 
+void Codec47Decoder::copyFrame(byte *dst) const {
+	finishScale();
+	memcpy(dst, _outputBuf, _frameSize);
+}
+
+void Codec47Decoder::finishScale() const {
+	if (_scaleDst) {
+		scaleFrame(_scaleDst, _scaleSrc);
+		_scaleDst = 0;
+	}
+}
+
+// The state is this header, followed by the whole delta buffer allocation
+// and then the packed interpolation table, if one has been loaded
+struct Codec47State {
+	int32 prevSeqNb;
+	byte bufIndex[4];
+	byte hasInterTable;
+};
+
+uint32 Codec47Decoder::getStateSize() const {
+	return sizeof(Codec47State) + _deltaSize + (_interTable ? InterpolationTable::kPackedSize : 0);
+}
+
+void Codec47Decoder::saveState(byte *dst) const {
+	finishScale();
+
+	Codec47State state;
+	state.prevSeqNb = _prevSeqNb;
+	state.bufIndex[0] = (_deltaBufs[0] - _deltaBuf) / _frameSize;
+	state.bufIndex[1] = (_deltaBufs[1] - _deltaBuf) / _frameSize;
+	state.bufIndex[2] = (_curBuf - _deltaBuf) / _frameSize;
+	state.bufIndex[3] = (_outputBuf - _deltaBuf) / _frameSize;
+	state.hasInterTable = _interTable != 0;
+
+	memcpy(dst, &state, sizeof(state));
+	dst += sizeof(state);
+	memcpy(dst, _deltaBuf, _deltaSize);
+	dst += _deltaSize;
+
+	if (_interTable)
+		memcpy(dst, _interTables.getPackedTable(), InterpolationTable::kPackedSize);
+}
+
+void Codec47Decoder::loadState(const byte *src) {
+	Codec47State state;
+	memcpy(&state, src, sizeof(state));
+	src += sizeof(state);
+
+	_prevSeqNb = state.prevSeqNb;
+	_deltaBufs[0] = _deltaBuf + state.bufIndex[0] * _frameSize;
+	_deltaBufs[1] = _deltaBuf + state.bufIndex[1] * _frameSize;
+	_curBuf = _deltaBuf + state.bufIndex[2] * _frameSize;
+	_outputBuf = _deltaBuf + state.bufIndex[3] * _frameSize;
+	_scaleDst = 0;
+	memcpy(_deltaBuf, src, _deltaSize);
+	src += _deltaSize;
+
+	// Normally built by the first frame, which we may never have seen
+	makeTables47(_width);
+
+	if (state.hasInterTable)
+		_interTable = _interTables.load(src);
+	else
+		_interTable = 0;
+}
+
 #define COPY_4X1_LINE(dst, src) \
 	do { \
 		(dst)[0] = (src)[0]; \
@@ -430,34 +573,38 @@ void Codec47Decoder::makeTables47(int width) {
 	} while (c < 32768);
 }
 
+template<int PITCH>
 void Codec47Decoder::level3(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp;
 	byte code = *_d_src++;
 
 	if (code < 0xF8) {
 		tmp = _table[code] + _offset1;
 		COPY_2X1_LINE(d_dst, d_dst + tmp);
-		COPY_2X1_LINE(d_dst + _d_pitch, d_dst + _d_pitch + tmp);
+		COPY_2X1_LINE(d_dst + pitch, d_dst + pitch + tmp);
 	} else if (code == 0xFF) {
 		COPY_2X1_LINE(d_dst, _d_src + 0);
-		COPY_2X1_LINE(d_dst + _d_pitch, _d_src + 2);
+		COPY_2X1_LINE(d_dst + pitch, _d_src + 2);
 		_d_src += 4;
 	} else if (code == 0xFE) {
 		byte t = *_d_src++;
 		FILL_2X1_LINE(d_dst, t);
-		FILL_2X1_LINE(d_dst + _d_pitch, t);
+		FILL_2X1_LINE(d_dst + pitch, t);
 	} else if (code == 0xFC) {
 		tmp = _offset2;
 		COPY_2X1_LINE(d_dst, d_dst + tmp);
-		COPY_2X1_LINE(d_dst + _d_pitch, d_dst + _d_pitch + tmp);
+		COPY_2X1_LINE(d_dst + pitch, d_dst + pitch + tmp);
 	} else {
 		byte t = _paramPtr[code];
 		FILL_2X1_LINE(d_dst, t);
-		FILL_2X1_LINE(d_dst + _d_pitch, t);
+		FILL_2X1_LINE(d_dst + pitch, t);
 	}
 }
 
+template<int PITCH>
 void Codec47Decoder::level2(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp;
 	byte code = *_d_src++;
 	int i;
@@ -466,21 +613,21 @@ void Codec47Decoder::level2(byte *d_dst) {
 		tmp = _table[code] + _offset1;
 		for (i = 0; i < 4; i++) {
 			COPY_4X1_LINE(d_dst, d_dst + tmp);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFF) {
-		level3(d_dst);
+		level3<PITCH>(d_dst);
 		d_dst += 2;
-		level3(d_dst);
-		d_dst += _d_pitch * 2 - 2;
-		level3(d_dst);
+		level3<PITCH>(d_dst);
+		d_dst += pitch * 2 - 2;
+		level3<PITCH>(d_dst);
 		d_dst += 2;
-		level3(d_dst);
+		level3<PITCH>(d_dst);
 	} else if (code == 0xFE) {
 		byte t = *_d_src++;
 		for (i = 0; i < 4; i++) {
 			FILL_4X1_LINE(d_dst, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFD) {
 		byte *tmp_ptr = _tableSmall + *_d_src++ * 128;
@@ -502,18 +649,20 @@ void Codec47Decoder::level2(byte *d_dst) {
 		tmp = _offset2;
 		for (i = 0; i < 4; i++) {
 			COPY_4X1_LINE(d_dst, d_dst + tmp);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else {
 		byte t = _paramPtr[code];
 		for (i = 0; i < 4; i++) {
 			FILL_4X1_LINE(d_dst, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	}
 }
 
+template<int PITCH>
 void Codec47Decoder::level1(byte *d_dst) {
+	const int pitch = PITCH ? PITCH : _d_pitch;
 	int32 tmp, tmp2;
 	byte code = *_d_src++;
 	int i;
@@ -523,22 +672,22 @@ void Codec47Decoder::level1(byte *d_dst) {
 		for (i = 0; i < 8; i++) {
 			COPY_4X1_LINE(d_dst + 0, d_dst + tmp2);
 			COPY_4X1_LINE(d_dst + 4, d_dst + tmp2 + 4);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFF) {
-		level2(d_dst);
+		level2<PITCH>(d_dst);
 		d_dst += 4;
-		level2(d_dst);
-		d_dst += _d_pitch * 4 - 4;
-		level2(d_dst);
+		level2<PITCH>(d_dst);
+		d_dst += pitch * 4 - 4;
+		level2<PITCH>(d_dst);
 		d_dst += 4;
-		level2(d_dst);
+		level2<PITCH>(d_dst);
 	} else if (code == 0xFE) {
 		byte t = *_d_src++;
 		for (i = 0; i < 8; i++) {
 			FILL_4X1_LINE(d_dst, t);
 			FILL_4X1_LINE(d_dst + 4, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else if (code == 0xFD) {
 		tmp = *_d_src++;
@@ -562,78 +711,236 @@ void Codec47Decoder::level1(byte *d_dst) {
 		for (i = 0; i < 8; i++) {
 			COPY_4X1_LINE(d_dst + 0, d_dst + tmp2);
 			COPY_4X1_LINE(d_dst + 4, d_dst + tmp2 + 4);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	} else {
 		byte t = _paramPtr[code];
 		for (i = 0; i < 8; i++) {
 			FILL_4X1_LINE(d_dst, t);
 			FILL_4X1_LINE(d_dst + 4, t);
-			d_dst += _d_pitch;
+			d_dst += pitch;
 		}
 	}
 }
 
+template<int PITCH>
 void Codec47Decoder::decode2(byte *dst, const byte *src, int width, int height, const byte *param_ptr) {
 	_d_src = src;
 	_paramPtr = param_ptr - 0xf8;
 	int bw = (width + 7) / 8;
 	int bh = (height + 7) / 8;
-	int next_line = width * 7;
+	int next_line = (PITCH ? PITCH : width) * 7;
 	_d_pitch = width;
 
+	// A block is unchanged if it copies the previous output from the same
+	// position: a zero motion vector when that's _deltaBufs[1], or 0xFC
+	// when it's _deltaBufs[0]. Each block row adds a rect spanning its
+	// changed blocks.
+	bool prevIsDelta1 = _prevOffset == _offset1;
+	bool prevIsDelta0 = _prevOffset == _offset2;
+	int y = 0;
+
 	do {
-		int tmp_bw = bw;
-		do {
-			level1(dst);
+		int minX = bw, maxX = -1;
+
+		for (int x = 0; x < bw; x++) {
+			byte code = *_d_src;
+			bool same = (code < 0xF8) ? (prevIsDelta1 && _table[code] == 0) : (prevIsDelta0 && code == 0xFC);
+
+			if (!same) {
+				minX = MIN(minX, x);
+				maxX = x;
+			}
+
+			level1<PITCH>(dst);
 			dst += 8;
-		} while (--tmp_bw);
+		}
+
+		if (maxX >= 0)
+			_dirty.addRect(Rect(minX * 8, y, (maxX + 1) * 8, y + 8));
+
 		dst += next_line;
+		y += 8;
 	} while (--bh);
 }
 
-void Codec47Decoder::bompDecodeLine(byte *dst, const byte *src, int len) {
-	while (len > 0) {
-		byte code = *src++;
-		byte num = (code >> 1) + 1;
+bool Codec47Decoder::validate(const byte *src, uint32 size) const {
+	const byte *end = src + size;
+	const byte *gfxData = src + kHeaderSize;
+
+	if ((src[4] & 1) != 0) {
+		if (end - gfxData < (int32)InterpolationTable::kPackedSize)
+			return false;
+
+		gfxData += InterpolationTable::kPackedSize;
+	}
+
+	switch (src[2]) {
+	case 0:
+		return end - gfxData >= _frameSize;
+	case 1:
+		return end - gfxData >= (_width / 2) * ((_height + 1) / 2);
+	case 2: {
+		int32 pos = 0;
+
+		for (int y = 0; y < _height; y += 8) {
+			for (int x = 0; x < _width; x += 8) {
+				bool safe = isInDeltaBuf(_curBuf - _deltaBuf + pos, 8);
+				int used = checkBlock(gfxData, end, pos, 8, safe);
+
+				if (used < 0 || !safe)
+					return false;
+
+				gfxData += used;
+				pos += 8;
+			}
+
+			pos += _width * 7;
+		}
+
+		return true;
+		}
+	case 5: {
+		int32 len = READ_LE_UINT32(src + 14);
+		return len <= _frameSize && bompGetDecodableLength(gfxData, end, len) == len;
+		}
+	}
+
+	return true;
+}
+
+bool Codec47Decoder::isInDeltaBuf(int32 offset, int size) const {
+	return offset >= 0 && offset + (size - 1) * _width + size <= _deltaSize;
+}
+
+int Codec47Decoder::checkBlock(const byte *src, const byte *end, int32 pos, int size, bool &safe) const {
+	// Mirrors level1/level2/level3: returns the number of bytes the block
+	// at pos uses, or -1 if the data ends first. Clears safe if it would
+	// copy from outside the delta buffers.
+	const byte *start = src;
+
+	if (src >= end)
+		return -1;
 
-		if (num > len)
-			num = len;
+	byte code = *src++;
 
-		len -= num;
+	if (code < 0xF8) {
+		if (!isInDeltaBuf(_deltaBufs[1] - _deltaBuf + pos + _table[code], size))
+			safe = false;
+	} else if (code == 0xFF) {
+		if (size == 2) {
+			if (end - src < 4)
+				return -1;
 
-		if (code & 1) {
-			byte color = *src++;
-			memset(dst, color, num);
+			src += 4;
 		} else {
-			memcpy(dst, src, num);
-			src += num;
+			int half = size / 2;
+			const int32 offsets[4] = { 0, half, _width * half, _width * half + half };
+
+			for (int i = 0; i < 4; i++) {
+				int used = checkBlock(src, end, pos + offsets[i], half, safe);
+
+				if (used < 0)
+					return -1;
+
+				src += used;
+			}
+		}
+	} else if (code == 0xFE) {
+		if (src >= end)
+			return -1;
+
+		src++;
+	} else if (code == 0xFD && size != 2) {
+		if (end - src < 3)
+			return -1;
+
+		src += 3;
+	} else if (code == 0xFC) {
+		if (!isInDeltaBuf(_deltaBufs[0] - _deltaBuf + pos, size))
+			safe = false;
+	}
+
+	return src - start;
+}
+
+void Codec47Decoder::decode2Checked(byte *dst, const byte *src, const byte *end, const byte *paramPtr) {
+	// Check each block right before decoding it. Blocks that would touch
+	// memory outside the delta buffers are skipped, and decoding stops
+	// when the data runs out.
+	_paramPtr = paramPtr - 0xf8;
+	_d_pitch = _width;
+
+	int32 pos = 0;
+
+	for (int y = 0; y < _height; y += 8) {
+		for (int x = 0; x < _width; x += 8) {
+			bool safe = isInDeltaBuf(dst - _deltaBuf + pos, 8);
+			int used = checkBlock(src, end, pos, 8, safe);
+
+			if (used < 0)
+				return;
+
+			if (safe) {
+				_d_src = src;
+				level1<0>(dst + pos);
+			}
+
+			src += used;
+			pos += 8;
 		}
 
-		dst += num;
+		pos += _width * 7;
 	}
 }
 
-void Codec47Decoder::scaleFrame(byte *dst, const byte *src) {
+void Codec47Decoder::scaleFrame(byte *dst, const byte *src) const {
 	byte *ptr = dst + _width;
+	int halfWidth = _width / 2;
 
 	// Interpolate the odd rows first
 	for (int y = 0; y < _height; y += 2) {
 		// The first two pixels are not interpolated
-		uint16 pixel = *src++;
-		*ptr++ = pixel;
-		*ptr++ = pixel;
-
-		for (int x = 2; x < _width; x += 2) {
-			// The first pixel of each duplet is not interpolated
-			// The second pixel is interpolated from the last one and the new one
-			pixel <<= 8;
-			pixel |= *src++;
-			*ptr++ = _interTable[pixel];
-			*ptr++ = pixel & 0xFF;
+		ptr[0] = ptr[1] = src[0];
+
+		// The first pixel of each duplet is interpolated from the last one
+		// and the new one, the second pixel is just the new one.
+		int x = 1;
+
+#ifdef __SSE2__
+		if (_interTables.hasIdentityDiagonal()) {
+			// Interpolated pixels between two equal source pixels are the
+			// pixel itself, so only the changing spots need a lookup.
+			for (; x + 16 <= halfWidth; x += 16) {
+				__m128i prev = _mm_loadu_si128((const __m128i *)(src + x - 1));
+				__m128i cur = _mm_loadu_si128((const __m128i *)(src + x));
+				__m128i inter = prev;
+				int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(prev, cur)) ^ 0xFFFF;
+
+				if (diff) {
+					byte tmp[16];
+					_mm_storeu_si128((__m128i *)tmp, prev);
+
+					for (int i = 0; i < 16; i++)
+						if (diff & (1 << i))
+							tmp[i] = _interTable[(src[x + i - 1] << 8) | src[x + i]];
+
+					inter = _mm_loadu_si128((const __m128i *)tmp);
+				}
+
+				_mm_storeu_si128((__m128i *)(ptr + x * 2), _mm_unpacklo_epi8(inter, cur));
+				_mm_storeu_si128((__m128i *)(ptr + x * 2 + 16), _mm_unpackhi_epi8(inter, cur));
+			}
+		}
+#endif
+
+		for (; x < halfWidth; x++) {
+			ptr[x * 2] = _interTable[(src[x - 1] << 8) | src[x]];
+			ptr[x * 2 + 1] = src[x];
 		}
-	
-		ptr += _width;
+
+		src += halfWidth;
+		ptr += _width * 2;
 	}
 
 	// The first row doesn't get interpolated, it's just a copy of the second row
@@ -642,11 +949,33 @@ void Codec47Decoder::scaleFrame(byte *dst, const byte *src) {
 
 	// Interpolate the even rows based on the odd rows
 	for (int y = 2; y < _height; y += 2) {
-		for (int x = 0; x < _width; x++) {
-			*ptr = _interTable[(ptr[_width] << 8) | ptr[-_width]];
-			ptr++;
-		}
+		interpolateRow(ptr, ptr + _width, ptr - _width, _width);
+		ptr += _width * 2;
+	}
+}
+
+void Codec47Decoder::interpolateRow(byte *dst, const byte *below, const byte *above, int width) const {
+	int x = 0;
+
+#ifdef __SSE2__
+	if (_interTables.hasIdentityDiagonal()) {
+		// Copy straight through wherever the rows above and below agree
+		for (; x + 16 <= width; x += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(above + x));
+			__m128i b = _mm_loadu_si128((const __m128i *)(below + x));
+			int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+
+			_mm_storeu_si128((__m128i *)(dst + x), a);
 
-		ptr += _width;
+			while (diff) {
+				int i = __builtin_ctz(diff);
+				dst[x + i] = _interTable[(below[x + i] << 8) | above[x + i]];
+				diff &= diff - 1;
+			}
+		}
 	}
+#endif
+
+	for (; x < width; x++)
+		dst[x] = _interTable[(below[x] << 8) | above[x]];
 }
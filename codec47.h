@@ -25,28 +25,70 @@
 #ifndef CODEC47_H
 #define CODEC47_H
 
+#include "dirtyregion.h"
+#include "intertable.h"
 #include "types.h"
 
 class Codec47Decoder {
 public:
 	Codec47Decoder(int width, int height);
 	~Codec47Decoder();
-	bool decode(byte *dst, const byte *src);
+	// dst may be 0 if the frame won't be shown, which skips everything
+	// that's only needed for output
+	bool decode(byte *dst, const byte *src, uint32 size);
+
+	/** Copy the last decoded frame, for when decode() was given no dst */
+	void copyFrame(byte *dst) const;
+
+	int getWidth() const { return _width; }
+	int getHeight() const { return _height; }
+
+	/** The part of the frame that differs from the previous decode() */
+	const DirtyRegion &getDirtyRegion() const { return _dirty; }
+
+	// State snapshots, so decoding can resume from an earlier frame. A
+	// state can only be loaded into a decoder with the same frame size.
+	uint32 getStateSize() const;
+	void saveState(byte *dst) const;
+	void loadState(const byte *src);
 
 private:
+	enum {
+		kHeaderSize = 26
+	};
+
 	void makeTablesInterpolation(int param);
 	void makeTables47(int width);
-	void level1(byte *d_dst);
-	void level2(byte *d_dst);
-	void level3(byte *d_dst);
-	void decode2(byte *dst, const byte *src, int width, int height, const byte *paramPtr);
-	void bompDecodeLine(byte *dst, const byte *src, int len);
-	void scaleFrame(byte *dst, const byte *src);
+
+	// The block functions are instantiated with a compile-time pitch for
+	// the common frame widths; a PITCH of 0 means use _d_pitch instead.
+	template<int PITCH> void level1(byte *d_dst);
+	template<int PITCH> void level2(byte *d_dst);
+	template<int PITCH> void level3(byte *d_dst);
+	template<int PITCH> void decode2(byte *dst, const byte *src, int width, int height, const byte *paramPtr);
+	typedef void (Codec47Decoder::*Decode2Proc)(byte *dst, const byte *src, int width, int height, const byte *paramPtr);
+	Decode2Proc _decode2;
+	void scaleFrame(byte *dst, const byte *src) const;
+	void interpolateRow(byte *dst, const byte *below, const byte *above, int width) const;
+
+	// Quarter-size frames that won't be shown are only scaled up once
+	// something needs the result
+	void finishScale() const;
+	byte *_scaleSrc;
+	mutable byte *_scaleDst;
+
+	// Chunks are checked once up front so that the block functions can run
+	// without any bounds checks. Chunks that fail go through decode2Checked.
+	bool validate(const byte *src, uint32 size) const;
+	int checkBlock(const byte *src, const byte *end, int32 pos, int size, bool &safe) const;
+	bool isInDeltaBuf(int32 offset, int size) const;
+	void decode2Checked(byte *dst, const byte *src, const byte *end, const byte *paramPtr);
 
 	int32 _deltaSize;
 	byte *_deltaBufs[2];
 	byte *_deltaBuf;
 	byte *_curBuf;
+	byte *_outputBuf;
 	int32 _prevSeqNb;
 	int _lastTableWidth;
 	const byte *_d_src, *_paramPtr;
@@ -57,7 +99,13 @@ private:
 	int16 _table[256];
 	int32 _frameSize;
 	int _width, _height;
-	byte *_interTable;
+	InterpolationTable _interTables;
+	const byte *_interTable;
+
+	// Blocks that copy the previous output at the same position are left
+	// out of _dirty. _prevOffset is where that output is from _curBuf.
+	DirtyRegion _dirty;
+	int32 _prevOffset;
 };
 
 #endif
@@ -23,7 +23,9 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include "bomp.h"
 #include "codec48.h"
+#include "framebuffer.h"
 #include "util.h"
 
 Codec48Decoder::Codec48Decoder(int width, int height) {
@@ -40,7 +42,7 @@ Codec48Decoder::Codec48Decoder(int width, int height) {
 	_frameSize = 640 * 480; // Yes, this is correct. Looks like the buffers are always this size
 
 	_curBuf = 0;
-	_deltaBuf[0] = new byte[_frameSize * 2];
+	_deltaBuf[0] = allocFrameBuffer(_frameSize * 2);
 	_deltaBuf[1] = _deltaBuf[0] + _frameSize;
 
 	_offsetTable = new int16[255];
@@ -51,15 +53,18 @@ Codec48Decoder::Codec48Decoder(int width, int height) {
 }
 
 Codec48Decoder::~Codec48Decoder() {
-	delete[] _deltaBuf[0];
+	freeFrameBuffer(_deltaBuf[0]);
 	delete[] _offsetTable;
-	delete[] _interTable;
 }
 
-bool Codec48Decoder::decode(byte *dst, const byte *src) {
+bool Codec48Decoder::decode(byte *dst, const byte *src, uint32 size) {
 	// The header is identical to codec 37, except the flags field is somewhat different
 
+	if (size < 0x10)
+		return false;
+
 	const byte *gfxData = src + 0x10;
+	const byte *end = src + size;
 
 	makeTable(_pitch, src[1]);
 
@@ -68,36 +73,20 @@ bool Codec48Decoder::decode(byte *dst, const byte *src) {
 	if (seqNb == 0)
 		memset(_deltaBuf[0], 0, _frameSize * 2);
 
-	if (src[12] & (1 << 3)) {
+	if ((src[12] & (1 << 3)) && end - gfxData >= (int32)InterpolationTable::kPackedSize) {
 		// Interpolation table present
-		if (!_interTable)
-			_interTable = new byte[65536];
-
-		byte *ptr = _interTable;
-
-		for (int i = 0; i < 256; i++) {
-			byte *ptr1 = ptr + i;
-			byte *ptr2 = ptr + i;
-
-			for (int j = 256 - i; j > 0; j--) {
-				byte pixel = *gfxData++;
-				*ptr2 = pixel;
-				*ptr1++ = pixel;
-				ptr2 += 256;
-			}
-
-			ptr += 256;
-		}
+		_interTable = _interTables.load(gfxData);
+		gfxData += InterpolationTable::kPackedSize;
 	}
 
 	switch (src[0]) {
 	case 0:
 		// Raw frame
-		memcpy(_deltaBuf[_curBuf], gfxData, READ_LE_UINT32(src + 4));
+		memcpy(_deltaBuf[_curBuf], gfxData, MIN<int32>(MIN<uint32>(READ_LE_UINT32(src + 4), _frameSize), end - gfxData));
 		break;
 	case 2:
 		// Blast object
-		bompDecodeLine(_deltaBuf[_curBuf], gfxData, _width * _height);
+		bompDecodeLine(_deltaBuf[_curBuf], gfxData, end, bompGetDecodableLength(gfxData, end, _width * _height));
 		break;
 	case 3:
 		// 8x8 block encoding
@@ -105,7 +94,10 @@ bool Codec48Decoder::decode(byte *dst, const byte *src) {
 			if (seqNb & 1 || !(src[12] & 1) || src[12] & 0x10)
 				_curBuf ^= 1;
 
-			decode3(_deltaBuf[_curBuf], gfxData, _deltaBuf[_curBuf ^ 1] - _deltaBuf[_curBuf]);
+			if (validate(src, size))
+				decode3<false>(_deltaBuf[_curBuf], gfxData, end, _deltaBuf[_curBuf ^ 1] - _deltaBuf[_curBuf]);
+			else
+				decode3<true>(_deltaBuf[_curBuf], gfxData, end, _deltaBuf[_curBuf ^ 1] - _deltaBuf[_curBuf]);
 		}
 		break;
 	case 5:
@@ -118,30 +110,173 @@ bool Codec48Decoder::decode(byte *dst, const byte *src) {
 	}
 
 	_prevSeqNb = seqNb;
-	memcpy(dst, _deltaBuf[_curBuf], _pitch * _height);
+
+	if (dst)
+		memcpy(dst, _deltaBuf[_curBuf], _pitch * _height);
+
 	return true;
 }
 
-void Codec48Decoder::bompDecodeLine(byte *dst, const byte *src, int len) {
-	while (len > 0) {
-		byte code = *src++;
-		byte num = (code >> 1) + 1;
+void Codec48Decoder::copyFrame(byte *dst) const {
+	memcpy(dst, _deltaBuf[_curBuf], _pitch * _height);
+}
+
+// The state is this header, followed by the block area of both delta
+// buffers and then the packed interpolation table, if one has been loaded.
+// Nothing outside the block area gets written, so the rest of the (always
+// 640x480) buffers stays zero.
+struct Codec48State {
+	int32 curBuf;
+	int16 prevSeqNb;
+	byte hasInterTable;
+};
+
+uint32 Codec48Decoder::getStateSize() const {
+	return sizeof(Codec48State) + _pitch * _blockY * 8 * 2 + (_interTable ? InterpolationTable::kPackedSize : 0);
+}
+
+void Codec48Decoder::saveState(byte *dst) const {
+	Codec48State state;
+	state.curBuf = _curBuf;
+	state.prevSeqNb = _prevSeqNb;
+	state.hasInterTable = _interTable != 0;
 
-		if (num > len)
-			num = len;
+	memcpy(dst, &state, sizeof(state));
+	dst += sizeof(state);
 
-		len -= num;
+	uint32 bufSize = _pitch * _blockY * 8;
+	memcpy(dst, _deltaBuf[0], bufSize);
+	memcpy(dst + bufSize, _deltaBuf[1], bufSize);
+	dst += bufSize * 2;
 
-		if (code & 1) {
-			byte color = *src++;
-			memset(dst, color, num);
-		} else {
-			memcpy(dst, src, num);
-			src += num;
+	if (_interTable)
+		memcpy(dst, _interTables.getPackedTable(), InterpolationTable::kPackedSize);
+}
+
+void Codec48Decoder::loadState(const byte *src) {
+	Codec48State state;
+	memcpy(&state, src, sizeof(state));
+	src += sizeof(state);
+
+	_curBuf = state.curBuf;
+	_prevSeqNb = state.prevSeqNb;
+
+	uint32 bufSize = _pitch * _blockY * 8;
+	memcpy(_deltaBuf[0], src, bufSize);
+	memcpy(_deltaBuf[1], src + bufSize, bufSize);
+	src += bufSize * 2;
+
+	if (state.hasInterTable)
+		_interTable = _interTables.load(src);
+	else
+		_interTable = 0;
+}
+
+bool Codec48Decoder::validate(const byte *src, uint32 size) const {
+	// Only the block encoding needs this, the other types are cheap to
+	// clip directly
+	const byte *end = src + size;
+	const byte *gfxData = src + 0x10;
+
+	if (src[12] & (1 << 3)) {
+		if (end - gfxData < (int32)InterpolationTable::kPackedSize)
+			return false;
+
+		gfxData += InterpolationTable::kPackedSize;
+	}
+
+	int32 pos = _deltaBuf[_curBuf] - _deltaBuf[0];
+	int bufOffset = _deltaBuf[_curBuf ^ 1] - _deltaBuf[_curBuf];
+
+	for (int i = 0; i < _blockY; i++) {
+		for (int j = 0; j < _blockX; j++) {
+			bool safe = true;
+			int used = checkBlock(gfxData, end, pos, bufOffset, safe);
+
+			if (used < 0 || !safe)
+				return false;
+
+			gfxData += used;
+			pos += 8;
 		}
 
-		dst += num;
+		pos += _pitch * 7;
+	}
+
+	return true;
+}
+
+bool Codec48Decoder::isInDeltaBuf(int32 offset, int width, int height) const {
+	// The buffers have kFrameGuardSize bytes of zeros in front, which the
+	// interpolated blocks along the top edge read from as the row above
+	return offset >= -kFrameGuardSize && offset + (height - 1) * _pitch + width <= _frameSize * 2;
+}
+
+int Codec48Decoder::checkBlock(const byte *src, const byte *end, int32 pos, int bufOffset, bool &safe) const {
+	// Returns the number of bytes the block at pos uses, or -1 if the data
+	// ends first. Clears safe if the block would touch memory outside the
+	// delta buffers.
+	static const int opcodeSizes[8] = { 32, 16, 16, 8, 4, 4, 2, 1 };
+
+	if (src >= end)
+		return -1;
+
+	byte opcode = *src++;
+	int used = (opcode >= 0xF8) ? opcodeSizes[opcode - 0xF8] : 0;
+
+	if (opcode == 0xF7)
+		used = 64;
+
+	if (end - src < used)
+		return -1;
+
+	if (!isInDeltaBuf(pos, 8, 8))
+		safe = false;
+
+	int32 ref = pos + bufOffset;
+
+	switch (opcode) {
+	case 0xFF:
+	case 0xFD:
+		// These look at the pixels above and to the left
+		if (!_interTable || !isInDeltaBuf(pos - _pitch - 1, 9, 6))
+			safe = false;
+		break;
+	case 0xFE:
+		if (!isInDeltaBuf(ref + (int16)READ_LE_UINT16(src), 8, 8))
+			safe = false;
+		break;
+	case 0xFC:
+		// The offset table only has 255 entries
+		for (int i = 0; i < 4; i++)
+			if (src[i] == 0xFF || !isInDeltaBuf(ref + _offsetTable[src[i]] + (i >> 1) * 4 * _pitch + (i & 1) * 4, 4, 4))
+				safe = false;
+		break;
+	case 0xFB:
+		for (int i = 0; i < 4; i++)
+			if (!isInDeltaBuf(ref + (int16)READ_LE_UINT16(src + i * 2) + (i >> 1) * 4 * _pitch + (i & 1) * 4, 4, 4))
+				safe = false;
+		break;
+	case 0xF9:
+		for (int i = 0; i < 16; i++)
+			if (src[i] == 0xFF || !isInDeltaBuf(ref + _offsetTable[src[i]] + (i >> 2) * 2 * _pitch + (i & 3) * 2, 2, 2))
+				safe = false;
+		break;
+	case 0xF8:
+		for (int i = 0; i < 16; i++)
+			if (!isInDeltaBuf(ref + (int16)READ_LE_UINT16(src + i * 2) + (i >> 2) * 2 * _pitch + (i & 3) * 2, 2, 2))
+				safe = false;
+		break;
+	case 0xFA:
+	case 0xF7:
+		break;
+	default:
+		if (!isInDeltaBuf(ref + _offsetTable[opcode], 8, 8))
+			safe = false;
+		break;
 	}
+
+	return used + 1;
 }
 
 void Codec48Decoder::makeTable(int pitch, int index) {
@@ -269,11 +404,28 @@ void Codec48Decoder::makeTable(int pitch, int index) {
 	}
 }
 
-void Codec48Decoder::decode3(byte *dst, const byte *src, int bufOffset) {
+template<bool CHECKED>
+void Codec48Decoder::decode3(byte *dst, const byte *src, const byte *end, int bufOffset) {
 	for (int i = 0; i < _blockY; i++) {
 		for (int j = 0; j < _blockX; j++) {
+			if (CHECKED) {
+				// Skip blocks that would go outside the delta buffers, and
+				// stop if the data runs out
+				bool safe = true;
+				int used = checkBlock(src, end, dst - _deltaBuf[0], bufOffset, safe);
+
+				if (used < 0)
+					return;
+
+				if (!safe) {
+					src += used;
+					dst += 8;
+					continue;
+				}
+			}
+
 			byte opcode = *src++;
-			
+
 
 			switch (opcode) {
 			case 0xFF: {
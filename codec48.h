@@ -23,20 +23,38 @@
 #ifndef CODEC48_H
 #define CODEC48_H
 
+#include "intertable.h"
 #include "types.h"
 
 class Codec48Decoder {
 public:
 	Codec48Decoder(int width, int height);
 	~Codec48Decoder();
-	bool decode(byte *dst, const byte *src);
+	// dst may be 0 if the frame won't be shown, which skips everything
+	// that's only needed for output
+	bool decode(byte *dst, const byte *src, uint32 size);
+
+	/** Copy the last decoded frame, for when decode() was given no dst */
+	void copyFrame(byte *dst) const;
+
+	int getWidth() const { return _width; }
+	int getHeight() const { return _height; }
+
+	// State snapshots, so decoding can resume from an earlier frame. A
+	// state can only be loaded into a decoder with the same frame size.
+	uint32 getStateSize() const;
+	void saveState(byte *dst) const;
+	void loadState(const byte *src);
 
 private:
 	void makeTable(int pitch, int index);
 
-	void bompDecodeLine(byte *dst, const byte *src, int len);
-
-	void decode3(byte *dst, const byte *src, int bufOffset);
+	// With CHECKED set, each block is checked before it is decoded. That's
+	// only used for chunks that failed validate().
+	template<bool CHECKED> void decode3(byte *dst, const byte *src, const byte *end, int bufOffset);
+	bool validate(const byte *src, uint32 size) const;
+	int checkBlock(const byte *src, const byte *end, int32 pos, int bufOffset, bool &safe) const;
+	bool isInDeltaBuf(int32 offset, int width, int height) const;
 	void scaleBlock(byte *dst, const byte *src);
 	void copyBlock(byte *dst, int deltaBufOffset, int offset);
 
@@ -49,7 +67,8 @@ private:
 	int16 _prevSeqNb;
 	int32 _frameSize;
 	int _width, _height;
-	byte *_interTable;
+	InterpolationTable _interTables;
+	const byte *_interTable;
 };
 
 #endif
@@ -0,0 +1,86 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "dirtyregion.h"
+#include "util.h"
+
+void Rect::extend(const Rect &r) {
+	left = MIN(left, r.left);
+	top = MIN(top, r.top);
+	right = MAX(right, r.right);
+	bottom = MAX(bottom, r.bottom);
+}
+
+void Rect::clip(int width, int height) {
+	left = CLIP(left, 0, width);
+	top = CLIP(top, 0, height);
+	right = CLIP(right, left, width);
+	bottom = CLIP(bottom, top, height);
+}
+
+void DirtyRegion::clear() {
+	_rects.clear();
+	_all = false;
+}
+
+void DirtyRegion::addRect(const Rect &rect) {
+	if (_all || rect.isEmpty())
+		return;
+
+	// Merge with every rect it touches. The merged rect can touch ones it
+	// didn't before, so start over after each merge.
+	Rect merged = rect;
+
+	for (uint i = 0; i < _rects.size();) {
+		if (_rects[i].touches(merged)) {
+			merged.extend(_rects[i]);
+			_rects.erase(_rects.begin() + i);
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+
+	_rects.push_back(merged);
+
+	if (_rects.size() > kMaxRects) {
+		for (uint i = 1; i < _rects.size(); i++)
+			_rects[0].extend(_rects[i]);
+
+		_rects.resize(1);
+	}
+}
+
+void DirtyRegion::add(const DirtyRegion &region) {
+	if (region._all) {
+		addAll();
+		return;
+	}
+
+	for (uint i = 0; i < region._rects.size(); i++)
+		addRect(region._rects[i]);
+}
+
+void DirtyRegion::addAll() {
+	_rects.clear();
+	_all = true;
+}
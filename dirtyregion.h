@@ -0,0 +1,78 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef DIRTYREGION_H
+#define DIRTYREGION_H
+
+#include <vector>
+
+#include "types.h"
+
+struct Rect {
+	int left, top, right, bottom;
+
+	Rect() : left(0), top(0), right(0), bottom(0) {}
+	Rect(int l, int t, int r, int b) : left(l), top(t), right(r), bottom(b) {}
+
+	int width() const { return right - left; }
+	int height() const { return bottom - top; }
+	bool isEmpty() const { return left >= right || top >= bottom; }
+
+	/** Whether the rects overlap or share an edge */
+	bool touches(const Rect &r) const {
+		return left <= r.right && r.left <= right && top <= r.bottom && r.top <= bottom;
+	}
+
+	void extend(const Rect &r);
+	void clip(int width, int height);
+};
+
+/**
+ * The parts of a frame that changed, as a short list of rects. Rects that
+ * touch are merged, and once there are too many of them they're merged
+ * into their bounding box, so the list stays cheap to upload.
+ */
+class DirtyRegion {
+public:
+	enum {
+		kMaxRects = 16
+	};
+
+	DirtyRegion() : _all(false) {}
+
+	void clear();
+	void addRect(const Rect &rect);
+	void add(const DirtyRegion &region);
+
+	/** Mark the whole frame, whatever its size */
+	void addAll();
+
+	bool isEmpty() const { return !_all && _rects.empty(); }
+	bool isAll() const { return _all; }
+	const std::vector<Rect> &getRects() const { return _rects; }
+
+private:
+	std::vector<Rect> _rects;
+	bool _all;
+};
+
+#endif
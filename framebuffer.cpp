@@ -0,0 +1,84 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "framebuffer.h"
+
+static const uint32 kHugePageSize = 2 * 1024 * 1024;
+
+static inline uint32 alignUp(uint32 size, uint32 alignment) {
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+byte *allocFrameBuffer(uint32 size, bool hugePages) {
+	uint32 alignment = kFrameAlignment;
+	uint32 totalSize = kFrameGuardSize + alignUp(size, kFrameAlignment) + kFrameGuardSize;
+
+	// Only bother with huge pages if we'd fill most of one
+	if (!hugePages || totalSize < kHugePageSize / 2)
+		hugePages = false;
+
+	if (hugePages) {
+		alignment = kHugePageSize;
+		totalSize = alignUp(totalSize, kHugePageSize);
+	}
+
+	void *base;
+
+#ifdef _WIN32
+	base = _aligned_malloc(totalSize, alignment);
+#else
+	if (posix_memalign(&base, alignment, totalSize) != 0)
+		base = 0;
+#endif
+
+	if (!base)
+		return 0;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	// This needs to happen before the memory is touched below
+	if (hugePages)
+		madvise(base, totalSize, MADV_HUGEPAGE);
+#endif
+
+	memset(base, 0, totalSize);
+	return (byte *)base + kFrameGuardSize;
+}
+
+void freeFrameBuffer(byte *buffer) {
+	if (!buffer)
+		return;
+
+#ifdef _WIN32
+	_aligned_free(buffer - kFrameGuardSize);
+#else
+	free(buffer - kFrameGuardSize);
+#endif
+}
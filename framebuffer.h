@@ -0,0 +1,50 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "types.h"
+
+enum {
+	/** Alignment of every frame buffer returned by allocFrameBuffer() */
+	kFrameAlignment = 64,
+
+	/**
+	 * Zero-filled slack before and after every frame buffer. This covers
+	 * a few rows at any SMUSH pitch, so vector code can load or store a
+	 * full register past either edge of the frame without checking.
+	 */
+	kFrameGuardSize = 4096
+};
+
+/**
+ * Allocate a zero-filled, kFrameAlignment-aligned frame buffer with
+ * kFrameGuardSize bytes of guard padding on either side. If hugePages
+ * is set, large buffers are backed by huge pages where the OS allows it.
+ */
+byte *allocFrameBuffer(uint32 size, bool hugePages = false);
+
+/** Free a buffer allocated with allocFrameBuffer() */
+void freeFrameBuffer(byte *buffer);
+
+#endif
@@ -0,0 +1,122 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <SDL.h>
+#include "framepacer.h"
+#include "util.h"
+
+FramePacer::FramePacer() : _startCounter(0), _frequency(1), _refreshPeriod(0), _lastVBlank(-1), _skippedFrames(0), _unchangedFrames(0) {
+}
+
+void FramePacer::start(int refreshRate) {
+	_frequency = SDL_GetPerformanceFrequency();
+	_refreshPeriod = (refreshRate > 0) ? 1000000 / refreshRate : 0;
+	_lastVBlank = -1;
+	_skippedFrames = 0;
+	_unchangedFrames = 0;
+	_presentTimes.clear();
+	_startCounter = SDL_GetPerformanceCounter();
+}
+
+int64 FramePacer::getTime() const {
+	uint64 ticks = SDL_GetPerformanceCounter() - _startCounter;
+
+	// Split up so that the multiply can't overflow
+	return (int64)((ticks / _frequency) * 1000000 + (ticks % _frequency) * 1000000 / _frequency);
+}
+
+void FramePacer::waitForPresent(int64 dueTime) {
+	int64 target = dueTime;
+
+	// Until the first present, there's no vblank to line up with
+	if (_refreshPeriod > 0 && _lastVBlank >= 0) {
+		// vblanks come every refresh period after the last one we saw.
+		// Pick the one nearest to when the frame is due, as long as it
+		// hasn't gone by already.
+		int64 now = getTime();
+		int64 nearest = _lastVBlank + (dueTime - _lastVBlank + _refreshPeriod / 2) / _refreshPeriod * _refreshPeriod;
+		int64 next = _lastVBlank + ((now - _lastVBlank) / _refreshPeriod + 1) * _refreshPeriod;
+		int64 vblank = MAX(nearest, next);
+
+		// Presenting blocks until the following vblank, so start half a
+		// refresh ahead of it to leave room for drawing either way
+		target = vblank - _refreshPeriod / 2;
+	}
+
+	waitUntil(target);
+}
+
+void FramePacer::waitUntil(int64 time) const {
+	for (;;) {
+		int64 left = time - getTime();
+
+		if (left <= 0)
+			break;
+
+		// SDL_Delay() can oversleep by a millisecond or so, so only sleep
+		// for the bulk of the wait and spin for the rest
+		if (left > 2000)
+			SDL_Delay((uint32)(left / 1000 - 1));
+	}
+}
+
+void FramePacer::framePresented(uint32 frame, int64 dueTime) {
+	int64 now = getTime();
+
+	// A vsync'd present returns just after the vblank it waited for
+	if (_refreshPeriod > 0)
+		_lastVBlank = now;
+
+	PresentTime presentTime;
+	presentTime.frame = frame;
+	presentTime.requested = dueTime;
+	presentTime.actual = now;
+	_presentTimes.push_back(presentTime);
+}
+
+void FramePacer::printReport() const {
+	if (_presentTimes.empty())
+		return;
+
+	printf("Frame presentation (ms):\n");
+	printf("%8s %10s %10s %8s\n", "Frame", "Requested", "Actual", "Late");
+
+	double totalError = 0.0;
+	double maxError = 0.0;
+
+	for (uint i = 0; i < _presentTimes.size(); i++) {
+		const PresentTime &presentTime = _presentTimes[i];
+		double late = (presentTime.actual - presentTime.requested) / 1000.0;
+
+		printf("%8u %10.2f %10.2f %+8.2f\n", presentTime.frame, presentTime.requested / 1000.0, presentTime.actual / 1000.0, late);
+
+		totalError += ABS(late);
+		maxError = MAX(maxError, ABS(late));
+	}
+
+	printf("%u frames presented, %u unchanged, %u skipped\n", (uint)_presentTimes.size(), _unchangedFrames, _skippedFrames);
+	printf("Average error %.2fms, worst %.2fms\n", totalError / _presentTimes.size(), maxError);
+
+	if (_refreshPeriod > 0)
+		printf("Aimed at vblanks every %.2fms\n", _refreshPeriod / 1000.0);
+}
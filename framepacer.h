@@ -0,0 +1,78 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <vector>
+#include "types.h"
+
+/**
+ * Decides when each frame gets presented, using the performance counter
+ * rather than millisecond ticks. With a vsync'd renderer, presenting
+ * blocks until a vblank, so the pacer aims each frame at the vblank
+ * closest to when it's due instead of whichever comes next.
+ *
+ * Times are in microseconds since start().
+ */
+class FramePacer {
+public:
+	FramePacer();
+
+	/** Start the clock. A refresh rate of 0 means presents aren't vsync'd. */
+	void start(int refreshRate);
+	int64 getTime() const;
+
+	/** Wait until it's time to present a frame that's due at dueTime */
+	void waitForPresent(int64 dueTime);
+
+	/** Record that a frame was just presented */
+	void framePresented(uint32 frame, int64 dueTime);
+
+	/** Record that a frame was decoded but not shown */
+	void frameSkipped() { _skippedFrames++; }
+
+	/** Record that a frame didn't need presenting, as nothing changed */
+	void frameUnchanged() { _unchangedFrames++; }
+
+	/** Print the requested and actual present time of each frame */
+	void printReport() const;
+
+private:
+	struct PresentTime {
+		uint32 frame;
+		int64 requested;
+		int64 actual;
+	};
+
+	void waitUntil(int64 time) const;
+
+	uint64 _startCounter;
+	uint64 _frequency;
+	int64 _refreshPeriod;
+	int64 _lastVBlank;
+	uint _skippedFrames;
+	uint _unchangedFrames;
+	std::vector<PresentTime> _presentTimes;
+};
+
+#endif
@@ -0,0 +1,182 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include "framebuffer.h"
+#include "framestore.h"
+#include "util.h"
+
+FrameStore::FrameStore() {
+	_pixels = 0;
+	_capacity = 0;
+	clear();
+}
+
+FrameStore::~FrameStore() {
+	freeFrameBuffer(_pixels);
+}
+
+void FrameStore::clear() {
+	// Keep the buffer around, the next video will probably want it too
+	_shared = 0;
+	_sharedPitch = 0;
+	_left = _top = 0;
+	_width = _height = 0;
+	_used = false;
+}
+
+bool FrameStore::reserve(uint32 size) {
+	if (_capacity >= size)
+		return true;
+
+	freeFrameBuffer(_pixels);
+	_pixels = allocFrameBuffer(size);
+	_capacity = _pixels ? size : 0;
+	return _pixels != 0;
+}
+
+void FrameStore::storeFrame(const byte *frame, uint width, uint height, uint pitch) {
+	_shared = frame;
+	_sharedPitch = pitch;
+	_left = _top = 0;
+	_width = width;
+	_height = height;
+	_used = true;
+}
+
+byte *FrameStore::storeRegion(int left, int top, uint width, uint height) {
+	if (!reserve(width * height)) {
+		_used = false;
+		return 0;
+	}
+
+	_shared = 0;
+	_left = left;
+	_top = top;
+	_width = width;
+	_height = height;
+	_used = true;
+	return _pixels;
+}
+
+void FrameStore::makeCopy() {
+	const byte *src = _shared;
+	_shared = 0;
+
+	if (!reserve(_width * _height)) {
+		_used = false;
+		return;
+	}
+
+	if (_sharedPitch == _width) {
+		memcpy(_pixels, src, _width * _height);
+	} else {
+		for (uint y = 0; y < _height; y++)
+			memcpy(_pixels + y * _width, src + y * _sharedPitch, _width);
+	}
+}
+
+void FrameStore::prepareWrite(const byte *frame) {
+	if (_used && _shared == frame)
+		makeCopy();
+}
+
+bool FrameStore::fetch(byte *frame, uint width, uint height, uint pitch, int xOffset, int yOffset) const {
+	if (!_used)
+		return false;
+
+	const byte *src = _shared ? _shared : _pixels;
+	uint srcPitch = _shared ? _sharedPitch : _width;
+
+	// Clip the moved region against the frame
+	int x = _left + xOffset, y = _top + yOffset;
+	int left = MAX<int>(x, 0), top = MAX<int>(y, 0);
+	int right = MIN<int>(x + (int)_width, width), bottom = MIN<int>(y + (int)_height, height);
+
+	if (left >= right || top >= bottom)
+		return true;
+
+	src += (top - y) * srcPitch + (left - x);
+	byte *dst = frame + top * pitch + left;
+
+	for (int i = top; i < bottom; i++) {
+		memcpy(dst, src, right - left);
+		src += srcPitch;
+		dst += pitch;
+	}
+
+	return true;
+}
+
+// The state is this header, followed by the pixels if anything is stored
+struct FrameStoreState {
+	int32 left, top;
+	uint32 width, height;
+	byte used;
+};
+
+uint32 FrameStore::getStateSize() const {
+	uint32 size = sizeof(FrameStoreState);
+
+	if (_used)
+		size += _width * _height;
+
+	return size;
+}
+
+void FrameStore::saveState(byte *dst) const {
+	FrameStoreState state;
+	state.left = _left;
+	state.top = _top;
+	state.width = _width;
+	state.height = _height;
+	state.used = _used;
+	memcpy(dst, &state, sizeof(state));
+	dst += sizeof(state);
+
+	if (!_used)
+		return;
+
+	const byte *src = _shared ? _shared : _pixels;
+	uint srcPitch = _shared ? _sharedPitch : _width;
+
+	for (uint y = 0; y < _height; y++) {
+		memcpy(dst, src + y * srcPitch, _width);
+		dst += _width;
+	}
+}
+
+void FrameStore::loadState(const byte *src) {
+	clear();
+
+	FrameStoreState state;
+	memcpy(&state, src, sizeof(state));
+	src += sizeof(state);
+
+	if (!state.used)
+		return;
+
+	byte *pixels = storeRegion(state.left, state.top, state.width, state.height);
+
+	if (pixels)
+		memcpy(pixels, src, state.width * state.height);
+}
@@ -0,0 +1,87 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include "types.h"
+
+/**
+ * The frame saved by STOR and brought back by FTCH.
+ *
+ * Storing the frame buffer doesn't copy anything: the store just refers to
+ * the buffer until prepareWrite() is called on it, which is when the copy
+ * is made. The store can also hold a region bigger than the screen, placed
+ * anywhere relative to it.
+ *
+ * All widths and positions here are in bytes, not pixels.
+ */
+class FrameStore {
+public:
+	FrameStore();
+	~FrameStore();
+
+	/** Throw away the stored frame */
+	void clear();
+
+	/** Store frame, replacing whatever was stored before */
+	void storeFrame(const byte *frame, uint width, uint height, uint pitch);
+
+	/**
+	 * Make the store hold a width x height region whose top left corner is
+	 * at (left, top) on the screen, and return it for the caller to fill in.
+	 * The region's pitch is its width. Returns 0 if it can't be allocated.
+	 */
+	byte *storeRegion(int left, int top, uint width, uint height);
+
+	/** Must be called before frame is changed if it might have been stored */
+	void prepareWrite(const byte *frame);
+
+	/**
+	 * Draw the stored frame onto frame, moved by (xOffset, yOffset) and
+	 * clipped to the frame. prepareWrite(frame) has to be called first.
+	 * Returns false if nothing has been stored.
+	 */
+	bool fetch(byte *frame, uint width, uint height, uint pitch, int xOffset, int yOffset) const;
+
+	// Snapshots of the stored frame, see SMUSHVideo::saveState()
+	uint32 getStateSize() const;
+	void saveState(byte *dst) const;
+	void loadState(const byte *src);
+
+private:
+	void makeCopy();
+	bool reserve(uint32 size);
+
+	byte *_pixels;
+	uint32 _capacity;
+
+	// The frame that's still shared, or 0 once there's a copy of it
+	const byte *_shared;
+	uint _sharedPitch;
+
+	int _left, _top;
+	uint _width, _height;
+	bool _used;
+};
+
+#endif
@@ -25,101 +25,450 @@
 #include <cstring>
 
 #include "graphicsman.h"
-
-// TODO: aspect ratio correction option
-// TODO: resize/scaling option
+#include "threadpool.h"
+#include "util.h"
 
 GraphicsManager::~GraphicsManager() {
-	if ( _palette )
-		SDL_FreePalette(_palette);
-	if ( _texture )
-		SDL_DestroyTexture(_texture);
+	for ( uint i = 0; i < kMaxTextures; i++ )
+		if ( _textures[i] )
+			SDL_DestroyTexture(_textures[i]);
 	if ( _renderer )
 		SDL_DestroyRenderer(_renderer);
+	if ( _surface )
+		SDL_FreeSurface(_surface);
 }
 
 bool GraphicsManager::init(SDL_Window *window, uint width, uint height, bool isHighColor) {
-	_width = width;
-	_height = height;
-	_isHighColor = isHighColor;
+	setFrameSize(width, height, isHighColor);
+
+	if ( window )
+		SDL_SetWindowSize(window, _outputWidth, _outputHeight);
 
 	// Create renderer
-	_renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	_renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (_vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 	if ( !_renderer )
 		return false;
 
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "best");
-	SDL_RenderSetScale(_renderer, width, height);
+	// Frame pacing needs to know how far apart the vblanks are
+	SDL_DisplayMode mode;
+	if ( SDL_GetWindowDisplayMode(window, &mode) == 0 )
+		_refreshRate = mode.refresh_rate;
+
+	return initRenderer();
+}
 
-	// Create texture
-	_texture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, _width, _height);
-	if ( !_texture ) {
+bool GraphicsManager::initOffscreen(uint width, uint height, bool isHighColor) {
+	setFrameSize(width, height, isHighColor);
+
+	// SDL's software renderer can draw into a plain surface, which needs
+	// neither a display nor a video driver
+	_surface = SDL_CreateRGBSurfaceWithFormat(0, _outputWidth, _outputHeight, 32, SDL_PIXELFORMAT_ARGB8888);
+	if ( !_surface )
+		return false;
+
+	_renderer = SDL_CreateSoftwareRenderer(_surface);
+	if ( !_renderer )
 		return false;
+
+	return initRenderer();
+}
+
+void GraphicsManager::setFrameSize(uint width, uint height, bool isHighColor) {
+	_width = width;
+	_height = height;
+	_isHighColor = isHighColor;
+
+	// The CPU scalers work on palette indices
+	if ( _isHighColor && _scaler.isEnabled() ) {
+		fprintf(stderr, "Scaling is only supported for 8bpp video\n");
+		_scaler.setMode(Scaler::kModeNone, false);
+	}
+
+	_outputWidth = _scaler.getScaledWidth(_width);
+	_outputHeight = _scaler.getScaledHeight(_height);
+}
+
+bool GraphicsManager::initRenderer() {
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "best");
+	SDL_RenderSetLogicalSize(_renderer, _outputWidth, _outputHeight);
+
+	// Create texture, in a format the renderer can use as-is so that it
+	// doesn't convert every upload again behind our back
+	SDL_RendererInfo info;
+	if ( SDL_GetRendererInfo(_renderer, &info) != 0 )
+		info.num_texture_formats = 0;
+
+	// The driver doesn't have to honour the vsync request
+	_vsync = _vsync && (info.flags & SDL_RENDERER_PRESENTVSYNC);
+
+	_textureFormat = chooseTextureFormat(info);
+	packPalette(0, 256);
+
+	// Rotating between textures means we're never writing into the one
+	// the renderer might still be drawing from
+	for ( uint i = 0; i < _textureCount; i++ ) {
+		_textures[i] = SDL_CreateTexture(_renderer, _textureFormat, SDL_TEXTUREACCESS_STREAMING, _outputWidth, _outputHeight);
+		if ( !_textures[i] )
+			return false;
+
+		_staleRegions[i].addAll();
 	}
 
 	return true;
 }
 
+static bool isPackableFormat(uint32 format) {
+	switch ( format ) {
+	case SDL_PIXELFORMAT_ARGB8888:
+	case SDL_PIXELFORMAT_RGB888:
+	case SDL_PIXELFORMAT_RGBA8888:
+	case SDL_PIXELFORMAT_RGBX8888:
+	case SDL_PIXELFORMAT_ABGR8888:
+	case SDL_PIXELFORMAT_BGR888:
+	case SDL_PIXELFORMAT_BGRA8888:
+	case SDL_PIXELFORMAT_BGRX8888:
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+static uint32 packColor(uint32 format, byte r, byte g, byte b) {
+	// These are all packed formats, so the shifts don't depend on the
+	// host byte order. The X formats get the alpha byte too, which the
+	// renderer ignores.
+	switch ( format ) {
+	case SDL_PIXELFORMAT_ARGB8888:
+	case SDL_PIXELFORMAT_RGB888:
+		return 0xFF000000 | (r << 16) | (g << 8) | b;
+	case SDL_PIXELFORMAT_ABGR8888:
+	case SDL_PIXELFORMAT_BGR888:
+		return 0xFF000000 | (b << 16) | (g << 8) | r;
+	case SDL_PIXELFORMAT_BGRA8888:
+	case SDL_PIXELFORMAT_BGRX8888:
+		return (b << 24) | (g << 16) | (r << 8) | 0xFF;
+	default:
+		break;
+	}
+
+	return (r << 24) | (g << 16) | (b << 8) | 0xFF;
+}
+
+uint32 GraphicsManager::chooseTextureFormat(const SDL_RendererInfo &info) const {
+	// Blocky16 frames are already RGB565, so if the renderer takes that
+	// they can be uploaded without touching the pixels at all
+	if ( _isHighColor ) {
+		for ( uint32 i = 0; i < info.num_texture_formats; i++ )
+			if ( info.texture_formats[i] == SDL_PIXELFORMAT_RGB565 )
+				return SDL_PIXELFORMAT_RGB565;
+	}
+
+	// Otherwise take the first (most preferred) 32bpp format we can pack
+	// the palette in
+	for ( uint32 i = 0; i < info.num_texture_formats; i++ )
+		if ( isPackableFormat(info.texture_formats[i]) )
+			return info.texture_formats[i];
+
+	// Every SDL renderer supports ARGB8888 one way or another
+	return SDL_PIXELFORMAT_ARGB8888;
+}
+
+void GraphicsManager::packPalette(uint start, uint count) {
+	for ( uint i = start; i < start + count; i++ )
+		_paletteLUT[i] = packColor(_textureFormat, _palette[i * 3], _palette[i * 3 + 1], _palette[i * 3 + 2]);
+}
+
 void GraphicsManager::setPalette(const byte *ptr, uint start, uint count) {
 	if ( count == 0 || !ptr || start + count > 256 )
 		return;
 
-	SDL_Color colors[256] = { 0 };
-	for ( uint i = 0; i < count; i++ ) {
-		colors[i].r = ptr[i * 3];
-		colors[i].g = ptr[i * 3 + 1];
-		colors[i].b = ptr[i * 3 + 2];
-		colors[i].a = 255;
-	}
+	// Videos often set the same palette again (or an XPAL with all-zero
+	// deltas), which doesn't need the frame reconverted
+	if ( !memcmp(_palette + start * 3, ptr, count * 3) )
+		return;
+
+	// Only the given entries are repacked; the conversion then needs a
+	// single load per pixel
+	memcpy(_palette + start * 3, ptr, count * 3);
+	packPalette(start, count);
+	_shadowFrameValid = false;
+	invalidateTextures();
+}
+
+void GraphicsManager::invalidateTextures() {
+	for ( uint i = 0; i < kMaxTextures; i++ )
+		_staleRegions[i].addAll();
+}
+
+void GraphicsManager::setShadowFrame(bool enable) {
+	_useShadowFrame = enable;
+	_shadowFrameValid = false;
 
-	if ( _palette )
-		SDL_FreePalette(_palette);
+	if ( !enable ) {
+		std::vector<uint32>().swap(_shadowFrame);
+		std::vector<byte>().swap(_shadowIndices);
+	}
+}
 
-	_palette = SDL_AllocPalette(count);
-	SDL_SetPaletteColors(_palette, colors, start, count);
+void GraphicsManager::convertIndexToRGBA(byte *dst, int dstPitch, const byte *src, int srcPitch, int width, int height) const {
+	for ( int y = 0; y < height; ++y )
+		convertIndexLine((uint32 *)(dst + y * dstPitch), src + y * srcPitch, width, _paletteLUT);
 }
 
-void GraphicsManager::convertIndexToRGBA(uint32_t *rgbaData, const byte *paletteData, int width, int height) const {
-	for ( int y = 0; y < height; ++y ) {
-		for ( int x = 0; x < width; ++x ) {
-			uint8_t index = paletteData[y * width + x];
-			SDL_Color color = _palette->colors[index];
-			rgbaData[y * width + x] = (color.r << 24) | (color.g << 16) | (color.b << 8) | (color.a);
+void GraphicsManager::updateShadowFrame(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch) {
+	if ( _shadowFrame.empty() ) {
+		_shadowFrame.resize(_width * _height);
+		_shadowIndices.resize(_width * _height);
+		_shadowFrameValid = false;
+	}
+
+	// Compare against the last indices row by row, then in 16 pixel spans
+	// within changed rows, and only convert the spans that differ.
+	// Comparing is a lot cheaper than converting.
+	const uint kSpan = 16;
+
+	for ( uint row = 0; row < height; row++ ) {
+		const byte *src = ptr + (y + row) * pitch + x;
+		byte *indices = &_shadowIndices[(y + row) * _width + x];
+		uint32 *dst = &_shadowFrame[(y + row) * _width + x];
+
+		if ( !_shadowFrameValid ) {
+			convertIndexToRGBA((byte *)dst, 0, src, 0, width, 1);
+			memcpy(indices, src, width);
+			continue;
+		}
+
+		if ( !memcmp(src, indices, width) )
+			continue;
+
+		// Neighbouring changed spans are converted together
+		uint runStart = 0;
+
+		for ( uint i = 0; i < width; i += kSpan ) {
+			// Keep the common case a constant size so the compare is inlined
+			bool same = (width - i >= kSpan) ? !memcmp(src + i, indices + i, kSpan) : !memcmp(src + i, indices + i, width - i);
+
+			if ( same ) {
+				if ( runStart < i ) {
+					convertIndexToRGBA((byte *)(dst + runStart), 0, src + runStart, 0, i - runStart, 1);
+					memcpy(indices + runStart, src + runStart, i - runStart);
+				}
+
+				runStart = i + kSpan;
+			}
+		}
+
+		if ( runStart < width ) {
+			convertIndexToRGBA((byte *)(dst + runStart), 0, src + runStart, 0, width - runStart, 1);
+			memcpy(indices + runStart, src + runStart, width - runStart);
 		}
 	}
+
+	// A partial blit leaves the rest of the shadow as it was, which is
+	// only right if it was valid before
+	if ( x == 0 && y == 0 && width == (uint)_width && height == (uint)_height )
+		_shadowFrameValid = true;
 }
 
 void GraphicsManager::blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch) {
-	if ( width == 0 || height == 0 )
-		return;
+	DirtyRegion region;
+	region.addRect(Rect(x, y, x + width, y + height));
+	blit(ptr, pitch, region);
+}
+
+void GraphicsManager::blit(const byte *ptr, uint pitch, const DirtyRegion &region) {
+	// Every texture has to catch up on the change, but only the one
+	// being drawn into now is written to
+	if ( !region.isEmpty() )
+		for ( uint i = 0; i < _textureCount; i++ )
+			_staleRegions[i].add(region);
+
+	// The first blit of a frame moves on to the next texture, so the one
+	// that was just presented can still be read by the renderer
+	if ( !_frameStarted ) {
+		if ( _staleRegions[_curTexture].isEmpty() )
+			return;
+
+		_curTexture = (_curTexture + 1) % _textureCount;
+		_frameStarted = true;
+	}
+
+	DirtyRegion &stale = _staleRegions[_curTexture];
+
+	if ( stale.isAll() ) {
+		uploadRect(ptr, 0, 0, _width, _height, pitch);
+	} else {
+		const std::vector<Rect> &rects = stale.getRects();
+
+		for ( uint i = 0; i < rects.size(); i++ ) {
+			Rect rect = rects[i];
+			rect.clip(_width, _height);
 
-	// Clip dimensions
-	if ( x + width > (uint)_width )
-		width = _width - x;
-	if ( y + height > (uint)_height )
-		height = _height - y;
+			if ( !rect.isEmpty() )
+				uploadRect(ptr, rect.left, rect.top, rect.width(), rect.height(), pitch);
+		}
+	}
 
+	stale.clear();
+	_needsPresent = true;
+}
 
+void GraphicsManager::uploadRect(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch) {
+	SDL_Texture *texture = _textures[_curTexture];
 	void *texPixels;
 	int texPitch;
-	SDL_LockTexture(_texture, NULL, &texPixels, &texPitch);
 
-	if ( _isHighColor )
-		SDL_ConvertPixels(width, height, SDL_PIXELFORMAT_RGB565, ptr + y * pitch + x, pitch, SDL_PIXELFORMAT_RGBA8888, texPixels, texPitch);
-	else {
-		convertIndexToRGBA((uint32_t *)texPixels, ptr + y * pitch + x, width, height);
+	if ( !_isHighColor && _useShadowFrame && !_scaler.isEnabled() ) {
+		SDL_Rect rect = { (int)x, (int)y, (int)width, (int)height };
+
+		uint64 start = SDL_GetPerformanceCounter();
+		updateShadowFrame(ptr, x, y, width, height, pitch);
+		uint64 lockStart = SDL_GetPerformanceCounter();
+
+		// Locked texture memory is write-only, so the whole region still
+		// has to be copied over
+		SDL_LockTexture(texture, &rect, &texPixels, &texPitch);
+		uint64 copyStart = SDL_GetPerformanceCounter();
+
+		for ( uint row = 0; row < height; row++ )
+			memcpy((byte *)texPixels + row * texPitch, &_shadowFrame[(y + row) * _width + x], width * 4);
+
+		uint64 unlockStart = SDL_GetPerformanceCounter();
+		SDL_UnlockTexture(texture);
+		uint64 end = SDL_GetPerformanceCounter();
+
+		_timings.lock.add(copyStart - lockStart);
+		_timings.convert.add((lockStart - start) + (unlockStart - copyStart));
+		_timings.unlock.add(end - unlockStart);
+		return;
+	}
+
+	Rect rect(x, y, x + width, y + height);
+
+	if ( _scaler.isEnabled() )
+		rect = _scaler.getOutputRect(rect, _width, _height);
+
+	SDL_Rect texRect = { rect.left, rect.top, rect.width(), rect.height() };
+
+	uint64 lockStart = SDL_GetPerformanceCounter();
+	SDL_LockTexture(texture, &texRect, &texPixels, &texPitch);
+	uint64 convertStart = SDL_GetPerformanceCounter();
+	convert((byte *)texPixels, texPitch, ptr, pitch, rect);
+	uint64 unlockStart = SDL_GetPerformanceCounter();
+	SDL_UnlockTexture(texture);
+	uint64 end = SDL_GetPerformanceCounter();
+
+	_timings.lock.add(convertStart - lockStart);
+	_timings.convert.add(unlockStart - convertStart);
+	_timings.unlock.add(end - unlockStart);
+}
+
+struct ConvertJob {
+	GraphicsManager *gfx;
+	byte *dst;
+	int dstPitch;
+	const byte *ptr;
+	uint pitch;
+	Rect rect;
+	int bandHeight;
+};
+
+void GraphicsManager::convertBand(void *param, int index) {
+	const ConvertJob *job = (const ConvertJob *)param;
+	Rect band = job->rect;
+	band.top += index * job->bandHeight;
+	band.bottom = MIN(band.top + job->bandHeight, job->rect.bottom);
+
+	job->gfx->convertRows(job->dst + (band.top - job->rect.top) * job->dstPitch, job->dstPitch, job->ptr, job->pitch, band, index);
+}
+
+void GraphicsManager::convert(byte *dst, int dstPitch, const byte *ptr, uint pitch, const Rect &rect) {
+	// Only big uploads are split into bands (one per thread), so a plain
+	// 320x200 frame never wakes the other threads
+	int bands = 1;
+
+	if ( _threadPool && rect.width() * rect.height() >= kParallelConvertMinPixels )
+		bands = MIN(_threadPool->getThreadCount(), rect.height() / kMinBandHeight);
+
+	if ( bands <= 1 ) {
+		convertRows(dst, dstPitch, ptr, pitch, rect, 0);
+		return;
 	}
 
-	SDL_UnlockTexture(_texture);
+	ConvertJob job;
+	job.gfx = this;
+	job.dst = dst;
+	job.dstPitch = dstPitch;
+	job.ptr = ptr;
+	job.pitch = pitch;
+	job.rect = rect;
+	job.bandHeight = (rect.height() + bands - 1) / bands;
+
+	// Every band scales into its own lines
+	_scaler.setBufferCount(bands);
+	_threadPool->run(convertBand, &job, (rect.height() + job.bandHeight - 1) / job.bandHeight);
 }
 
-void GraphicsManager::update() {
+void GraphicsManager::convertRows(byte *dst, int dstPitch, const byte *ptr, uint pitch, const Rect &rect, int buffer) {
+	// rect is in output pixels, which only differ from the frame's when
+	// scaling
+	if ( _scaler.isEnabled() ) {
+		_scaler.scale(dst, dstPitch, rect, ptr, pitch, _width, _height, _paletteLUT, buffer);
+	} else if ( _textureFormat == SDL_PIXELFORMAT_RGB565 ) {
+		const byte *src = ptr + rect.top * pitch + rect.left * 2;
+
+		for ( int row = 0; row < rect.height(); row++ )
+			memcpy(dst + row * dstPitch, src + row * pitch, rect.width() * 2);
+	} else if ( _isHighColor ) {
+		SDL_ConvertPixels(rect.width(), rect.height(), SDL_PIXELFORMAT_RGB565, ptr + rect.top * pitch + rect.left * 2, pitch, _textureFormat, dst, dstPitch);
+	} else {
+		convertIndexToRGBA(dst, dstPitch, ptr + rect.top * pitch + rect.left, pitch, rect.width(), rect.height());
+	}
+}
+
+bool GraphicsManager::update() {
+	if ( !_needsPresent )
+		return false;
+
+	_needsPresent = false;
+	_frameStarted = false;
+
+	uint64 start = SDL_GetPerformanceCounter();
+
 	// Clear renderer
 	SDL_RenderClear(_renderer);
 
-	// Copy entire texture to renderer
-	SDL_RenderCopy(_renderer, _texture, NULL, NULL);
+	// Copy the newest texture to renderer
+	SDL_RenderCopy(_renderer, _textures[_curTexture], NULL, NULL);
 
 	// Present renderer
 	SDL_RenderPresent(_renderer);
-}
\ No newline at end of file
+
+	_timings.present.add(SDL_GetPerformanceCounter() - start);
+	return true;
+}
+
+void GraphicsManager::setScaler(Scaler::Mode mode, bool aspectRatio) {
+	_scaler.setMode(mode, aspectRatio);
+}
+
+void GraphicsManager::setTextureCount(uint count) {
+	_textureCount = CLIP<uint>(count, 1, kMaxTextures);
+}
+
+void GraphicsManager::printTimings() const {
+	printf("Graphics timings (average/max in microseconds):\n");
+	printTiming("Lock", _timings.lock);
+	printTiming("Convert", _timings.convert);
+	printTiming("Unlock", _timings.unlock);
+	printTiming("Present", _timings.present);
+}
+
+void GraphicsManager::printTiming(const char *name, const Timing &timing) const {
+	double scale = 1000000.0 / SDL_GetPerformanceFrequency();
+	double average = timing.count ? timing.total * scale / timing.count : 0.0;
+
+	printf("\t%-8s %9.1f %9.1f (%u calls)\n", name, average, timing.max * scale, timing.count);
+}
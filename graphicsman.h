@@ -23,29 +23,148 @@
 #ifndef GRAPHICSMAN_H
 #define GRAPHICSMAN_H
 
+#include <vector>
+
+#include "dirtyregion.h"
+#include "scaler.h"
 #include "types.h"
 
+struct SDL_Surface;
 struct SDL_Window;
 struct SDL_Renderer;
 struct SDL_Texture;
+struct SDL_RendererInfo;
+class ThreadPool;
 
 class GraphicsManager {
 public:
 	GraphicsManager() = default;
 	~GraphicsManager();
 	bool init(SDL_Window *window, uint width, uint height, bool highColor);
+
+	/**
+	 * Draw with SDL's software renderer into a surface instead of a
+	 * window. Everything works the same, down to presenting, so the whole
+	 * display path can be measured without a display.
+	 */
+	bool initOffscreen(uint width, uint height, bool highColor);
 	void blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch);
-	void update();
+
+	/**
+	 * Convert and upload only the changed parts of a full frame, along
+	 * with whatever the texture being written missed while the others
+	 * were in use. Falls back to the whole frame when the texture is out
+	 * of date, such as after a palette change.
+	 */
+	void blit(const byte *ptr, uint pitch, const DirtyRegion &region);
+	// Presents the texture, unless nothing was uploaded since last time.
+	// Returns whether it presented.
+	bool update();
+
+	/** Make the next update() present even if nothing changed */
+	void invalidate() { _needsPresent = true; }
 	void setPalette(const byte *ptr, uint start, uint count);
 
+	// With the shadow frame on (8bpp only), the converted frame is kept
+	// along with the indices it came from, so each blit only converts the
+	// pixels that changed. Palette changes reconvert everything.
+	void setShadowFrame(bool enable);
+
+	// Scale 8bpp video on the CPU, and resize the window to match. Only
+	// takes effect if set before init(). The shadow frame isn't used
+	// while scaling.
+	void setScaler(Scaler::Mode mode, bool aspectRatio);
+
+	// Ask for presents to wait for vblank. Only takes effect if set before
+	// init(); afterwards, hasVSync() says whether the renderer agreed.
+	void setVSync(bool enable) { _vsync = enable; }
+	bool hasVSync() const { return _vsync; }
+
+	/** The display's refresh rate in Hz, or 0 if it isn't known */
+	int getRefreshRate() const { return _refreshRate; }
+
+	// How many streaming textures to rotate between (1-3). Only takes
+	// effect if set before init().
+	void setTextureCount(uint count);
+
+	// Split big conversions across a thread pool, which is shared with
+	// the decoder. Without one, every frame is converted on this thread.
+	void setThreadPool(ThreadPool *pool) { _threadPool = pool; }
+
+	/** Print how long locking, converting, unlocking and presenting took */
+	void printTimings() const;
+
 private:
-	void convertIndexToRGBA(uint32_t *rgbaData, const byte *paletteData, int width, int height) const;
+	enum {
+		kMaxTextures = 3,
+
+		// Uploads at least this big are converted in parallel bands
+		kParallelConvertMinPixels = 320 * 400,
+		kMinBandHeight = 16
+	};
+
+	struct Timing {
+		uint64 total = 0;
+		uint64 max   = 0;
+		uint32 count = 0;
+
+		void add(uint64 ticks) {
+			total += ticks;
+			if ( ticks > max )
+				max = ticks;
+			count++;
+		}
+	};
+
+	struct Timings {
+		Timing lock;
+		Timing convert;
+		Timing unlock;
+		Timing present;
+	};
+
+	void uploadRect(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch);
+	void convert(byte *dst, int dstPitch, const byte *ptr, uint pitch, const Rect &rect);
+	void convertRows(byte *dst, int dstPitch, const byte *ptr, uint pitch, const Rect &rect, int buffer);
+	static void convertBand(void *param, int index);
+	void invalidateTextures();
+	void printTiming(const char *name, const Timing &timing) const;
+	void setFrameSize(uint width, uint height, bool highColor);
+	bool initRenderer();
+	uint32 chooseTextureFormat(const SDL_RendererInfo &info) const;
+	void packPalette(uint start, uint count);
+	void convertIndexToRGBA(byte *dst, int dstPitch, const byte *src, int srcPitch, int width, int height) const;
+	void updateShadowFrame(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch);
+	SDL_Surface *_surface   = nullptr;
 	SDL_Renderer *_renderer = nullptr;
-	SDL_Texture *_texture   = nullptr;
-	SDL_Palette *_palette   = nullptr;
+	SDL_Texture *_textures[kMaxTextures] = { nullptr };
+	uint32 _textureFormat   = 0;
+	uint _textureCount      = 2;
+	uint _curTexture        = 0;
+	bool _frameStarted      = false;
+
+	// What each texture is missing compared to the latest frame
+	DirtyRegion _staleRegions[kMaxTextures];
+	Timings _timings;
+	ThreadPool *_threadPool = nullptr;
+
+	// The palette as given, and already packed in _textureFormat's pixel
+	// layout
+	byte _palette[256 * 3]  = { 0 };
+	uint32 _paletteLUT[256] = { 0 };
 	int _width  = 0;
 	int _height = 0;
+	int _outputWidth  = 0;
+	int _outputHeight = 0;
+	Scaler _scaler;
 	bool _isHighColor = false;
+	bool _needsPresent = true;
+	bool _vsync = false;
+	int _refreshRate = 0;
+	bool _useShadowFrame = false;
+	bool _shadowFrameValid = false;
+	std::vector<uint32> _shadowFrame;
+	std::vector<byte> _shadowIndices;
 };
 
 #endif
@@ -0,0 +1,105 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "iact.h"
+
+static inline const byte *decodeSample(const byte *src, int16 *dest, int shift) {
+	if (*src == 0x80) {
+		*dest = (int16)((src[1] << 8) | src[2]);
+		return src + 3;
+	}
+
+	*dest = (int16)((int8)*src * (1 << shift));
+	return src + 1;
+}
+
+void decompressIACT(const byte *src, uint32 srcSize, int16 *dest) {
+	const byte *end = src + srcSize;
+	int16 *destEnd = dest + kIACTBlockSamples * 2;
+
+	if (srcSize == 0) {
+		memset(dest, 0, kIACTBlockSize);
+		return;
+	}
+
+	// The first byte holds the left and right channel shifts. Each sample
+	// is then a byte shifted up by those, or 0x80 followed by a raw
+	// big endian sample.
+	const int leftShift = *src >> 4;
+	const int rightShift = *src & 0xF;
+	src++;
+
+#ifdef __SSE2__
+	const __m128i escape = _mm_set1_epi8((char)0x80);
+	const __m128i leftMask = _mm_set1_epi32(0xFFFF);
+	const __m128i leftCount = _mm_cvtsi32_si128(leftShift);
+	const __m128i rightCount = _mm_cvtsi32_si128(rightShift);
+#endif
+
+	// Whole pairs are decoded while there's enough data left that no
+	// checks are needed. Each sample takes up to three bytes.
+	while (destEnd - dest >= 16 && end - src >= 16 * 3) {
+#ifdef __SSE2__
+		// Escapes are rare, so take eight sample pairs at a time when
+		// none of them are escaped
+		__m128i in = _mm_loadu_si128((const __m128i *)src);
+
+		if (!_mm_movemask_epi8(_mm_cmpeq_epi8(in, escape))) {
+			// Sign extend to 16 bits, then shift the left and right
+			// samples by their own amounts
+			__m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(in, in), 8);
+			__m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(in, in), 8);
+
+			lo = _mm_or_si128(_mm_and_si128(leftMask, _mm_sll_epi16(lo, leftCount)), _mm_andnot_si128(leftMask, _mm_sll_epi16(lo, rightCount)));
+			hi = _mm_or_si128(_mm_and_si128(leftMask, _mm_sll_epi16(hi, leftCount)), _mm_andnot_si128(leftMask, _mm_sll_epi16(hi, rightCount)));
+
+			_mm_storeu_si128((__m128i *)dest, lo);
+			_mm_storeu_si128((__m128i *)(dest + 8), hi);
+			src += 16;
+			dest += 16;
+			continue;
+		}
+#endif
+
+		for (int i = 0; i < 8; i++) {
+			src = decodeSample(src, dest++, leftShift);
+			src = decodeSample(src, dest++, rightShift);
+		}
+	}
+
+	// The rest is checked, in case the block is short
+	while (dest < destEnd && src < end) {
+		int shift = ((destEnd - dest) & 1) ? rightShift : leftShift;
+
+		if (*src == 0x80 && end - src < 3)
+			break;
+
+		src = decodeSample(src, dest++, shift);
+	}
+
+	if (dest < destEnd)
+		memset(dest, 0, (destEnd - dest) * 2);
+}
@@ -0,0 +1,39 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef IACT_H
+#define IACT_H
+
+#include "types.h"
+
+enum {
+	// Each IACT audio block decodes to this many 16-bit stereo samples
+	kIACTBlockSamples = 1024,
+	kIACTBlockSize = kIACTBlockSamples * 2 * 2
+};
+
+// Decode an IACT audio block (without its length prefix) into
+// kIACTBlockSize bytes of native endian 16-bit samples. Samples missing
+// from the end of the block decode as silence.
+void decompressIACT(const byte *src, uint32 srcSize, int16 *dest);
+
+#endif
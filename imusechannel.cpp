@@ -138,37 +138,30 @@ void IMuseChannel::queueSamples() {
 	if (bytesLeft == 0)
 		return;
 
-	if (_bitsPerSample == 8) {
-		byte *buffer = new byte[bytesLeft];
-		memcpy(buffer, _data + _dataConsumed, bytesLeft);
-		_stream->queueAudioStream(makePCMStream(buffer, bytesLeft, _rate, _channels, FLAG_UNSIGNED));
-	} else if (_bitsPerSample == 12) {
-		uint decompressedSize = bytesLeft / 3 * 2;
-		int16 *buffer = new int16[decompressedSize];
-		decode12(_data + _dataConsumed, buffer, bytesLeft / 3);
+	// Everything is unpacked straight into the buffer that's mixed from
+	BufferPool &pool = _audio->getBufferPool();
 
-		int flags = FLAG_16BITS;
+	int flags = FLAG_16BITS;
 #if SDL_BYTEORDER == SDL_LIL_ENDIAN
-		flags |= FLAG_LITTLE_ENDIAN;
+	flags |= FLAG_LITTLE_ENDIAN;
 #endif
 
-		_stream->queueAudioStream(makePCMStream((byte *)buffer, decompressedSize * 2, _rate, _channels, flags));
+	if (_bitsPerSample == 8) {
+		uint32 outSize = bytesLeft * 2;
+		byte *buffer = pool.acquire(outSize);
+		convertUnsigned8BitSamples((int16 *)buffer, _data + _dataConsumed, bytesLeft);
+		_stream->queueAudioStream(makePCMStream(buffer, outSize, _rate, _channels, flags, pool));
+	} else if (_bitsPerSample == 12) {
+		uint32 outSize = bytesLeft / 3 * 4;
+		byte *buffer = pool.acquire(outSize);
+		unpack12BitSamples((int16 *)buffer, _data + _dataConsumed, bytesLeft / 3);
+		_stream->queueAudioStream(makePCMStream(buffer, outSize, _rate, _channels, flags, pool));
 	} else if (_bitsPerSample == 16) {
-		byte *buffer = new byte[bytesLeft];
+		byte *buffer = pool.acquire(bytesLeft);
 		memcpy(buffer, _data + _dataConsumed, bytesLeft);
-		_stream->queueAudioStream(makePCMStream(buffer, bytesLeft, _rate, _channels, FLAG_16BITS));
+		_stream->queueAudioStream(makePCMStream(buffer, bytesLeft, _rate, _channels, FLAG_16BITS, pool));
 	}
 
 	_dataConsumed += bytesLeft;
 	_totalDataUsed += bytesLeft;
 }
-
-void IMuseChannel::decode12(const byte *src, int16 *dst, uint32 size) {
-	while (size--) {
-		byte v1 = *src++;
-		byte v2 = *src++;
-		byte v3 = *src++;
-		*dst++ = ((((v2 & 0xF) << 8) | v1) << 4) - 0x8000;
-		*dst++ = ((((v2 & 0xF0) << 4) | v3) << 4) - 0x8000;
-	}
-}
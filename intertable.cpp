@@ -0,0 +1,117 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include "intertable.h"
+
+InterpolationTable::InterpolationTable() {
+	for (int i = 0; i < kCacheSize; i++) {
+		_entries[i].hash = 0;
+		_entries[i].packed = 0;
+		_entries[i].table = 0;
+		_entries[i].identityDiagonal = false;
+	}
+
+	_cur = 0;
+	_nextEntry = 0;
+}
+
+InterpolationTable::~InterpolationTable() {
+	for (int i = 0; i < kCacheSize; i++) {
+		delete[] _entries[i].packed;
+		delete[] _entries[i].table;
+	}
+}
+
+const byte *InterpolationTable::load(const byte *src) {
+	uint32 hash = hashPacked(src);
+
+	// Check if we've already expanded this table
+	for (int i = 0; i < kCacheSize; i++) {
+		Entry &entry = _entries[i];
+
+		if (entry.table && entry.hash == hash && !memcmp(entry.packed, src, kPackedSize)) {
+			_cur = &entry;
+			return entry.table;
+		}
+	}
+
+	// Replace the oldest entry
+	Entry &entry = _entries[_nextEntry];
+	_nextEntry = (_nextEntry + 1) % kCacheSize;
+
+	if (!entry.table) {
+		entry.packed = new byte[kPackedSize];
+		entry.table = new byte[65536];
+	}
+
+	entry.hash = hash;
+	memcpy(entry.packed, src, kPackedSize);
+	expand(entry.table, src);
+
+	entry.identityDiagonal = true;
+	for (int i = 0; i < 256 && entry.identityDiagonal; i++)
+		if (entry.table[(i << 8) | i] != i)
+			entry.identityDiagonal = false;
+
+	_cur = &entry;
+	return entry.table;
+}
+
+uint32 InterpolationTable::hashPacked(const byte *src) {
+	// FNV-1a over four interleaved 32-bit lanes, so the multiplies
+	// don't serialize. kPackedSize is a multiple of 16.
+	uint32 h0 = 2166136261u, h1 = 2166136261u ^ 1, h2 = 2166136261u ^ 2, h3 = 2166136261u ^ 3;
+
+	for (uint32 i = 0; i < kPackedSize; i += 16) {
+		uint32 words[4];
+		memcpy(words, src + i, 16);
+		h0 = (h0 ^ words[0]) * 16777619u;
+		h1 = (h1 ^ words[1]) * 16777619u;
+		h2 = (h2 ^ words[2]) * 16777619u;
+		h3 = (h3 ^ words[3]) * 16777619u;
+	}
+
+	return h0 ^ (h1 << 7 | h1 >> 25) ^ (h2 << 14 | h2 >> 18) ^ (h3 << 21 | h3 >> 11);
+}
+
+void InterpolationTable::expand(byte *dst, const byte *src) {
+	// Row i of the packed table holds entries (i, i) through (i, 255).
+	// Build the square table one output row at a time: the part right of
+	// the diagonal is a straight copy of packed row r, and the part left of
+	// it walks down column r of the packed rows above. That keeps all the
+	// writes sequential instead of striding through the table.
+	const byte *row = src;
+
+	for (int r = 0; r < 256; r++) {
+		byte *out = dst + (r << 8);
+		const byte *col = src + r;
+
+		for (int c = 0; c < r; c++) {
+			out[c] = *col;
+			col += 255 - c;
+		}
+
+		memcpy(out + r, row, 256 - r);
+		row += 256 - r;
+	}
+}
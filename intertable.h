@@ -0,0 +1,78 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef INTERTABLE_H
+#define INTERTABLE_H
+
+#include "types.h"
+
+/**
+ * The pixel interpolation table used by codecs 47 and 48.
+ *
+ * The table is stored in the stream as the upper triangle of a symmetric
+ * 256x256 matrix. Videos tend to send the same table over and over, so a
+ * few expanded tables are kept around, keyed by a hash of the packed bytes.
+ */
+class InterpolationTable {
+public:
+	InterpolationTable();
+	~InterpolationTable();
+
+	/** Size of the packed (triangular) table in the stream */
+	static const uint32 kPackedSize = 256 * 257 / 2;
+
+	/**
+	 * Load a packed table from the stream and return the expanded 64KB
+	 * table, indexed by (a << 8) | b.
+	 */
+	const byte *load(const byte *src);
+
+	/** Get the currently loaded table, or 0 if none has been loaded */
+	const byte *getTable() const { return _cur ? _cur->table : 0; }
+
+	/** Get the packed form of the current table, or 0 if none has been loaded */
+	const byte *getPackedTable() const { return _cur ? _cur->packed : 0; }
+
+	/** Does the current table map every (a, a) pair back to a? */
+	bool hasIdentityDiagonal() const { return _cur && _cur->identityDiagonal; }
+
+private:
+	enum {
+		kCacheSize = 4
+	};
+
+	struct Entry {
+		uint32 hash;
+		byte *packed;
+		byte *table;
+		bool identityDiagonal;
+	};
+
+	static uint32 hashPacked(const byte *src);
+	static void expand(byte *dst, const byte *src);
+
+	Entry _entries[kCacheSize];
+	Entry *_cur;
+	uint _nextEntry;
+};
+
+#endif
@@ -25,7 +25,11 @@
 // respectively).
 
 #include <string.h> // for size_t
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "audiostream.h"
+#include "bufferpool.h"
 #include "pcm.h"
 #include "util.h"
 
@@ -52,13 +56,16 @@ protected:
 	byte *_data, *_curSample;
 	uint32 _size;
 	const bool _disposeAfterUse;         ///< Indicates whether the stream object should be deleted when this RawStream is destructed
+	BufferPool *_pool;                   ///< Where the data goes back to when done with, if it came from a pool
 
 public:
-	PCMStream(int rate, int channels, bool disposeStream, byte *data, uint32 size)
-		: _rate(rate), _channels(channels), _data(data), _curSample(data), _size(size), _disposeAfterUse(disposeStream) {}
+	PCMStream(int rate, int channels, bool disposeStream, byte *data, uint32 size, BufferPool *pool)
+		: _rate(rate), _channels(channels), _data(data), _curSample(data), _size(size), _disposeAfterUse(disposeStream), _pool(pool) {}
 
 	virtual ~PCMStream() {
-		if (_disposeAfterUse)
+		if (_pool)
+			_pool->release(_data);
+		else if (_disposeAfterUse)
 			delete[] _data;
 	}
 
@@ -93,14 +100,14 @@ int PCMStream<is16Bit, isUnsigned, isLE>::readBuffer(int16 *buffer, const int nu
 #define MAKE_RAW_STREAM(UNSIGNED) \
 	if (is16Bit) { \
 		if (isLE) \
-			return new PCMStream<true, UNSIGNED, true>(rate, channels, disposeAfterUse, data, size); \
+			return new PCMStream<true, UNSIGNED, true>(rate, channels, disposeAfterUse, data, size, pool); \
 		else  \
-			return new PCMStream<true, UNSIGNED, false>(rate, channels, disposeAfterUse, data, size); \
+			return new PCMStream<true, UNSIGNED, false>(rate, channels, disposeAfterUse, data, size, pool); \
 	} else \
-		return new PCMStream<false, UNSIGNED, false>(rate, channels, disposeAfterUse, data, size)
+		return new PCMStream<false, UNSIGNED, false>(rate, channels, disposeAfterUse, data, size, pool)
 
 
-AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, bool disposeAfterUse) {
+static AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, bool disposeAfterUse, BufferPool *pool) {
 	const bool is16Bit    = (flags & FLAG_16BITS) != 0;
 	const bool isUnsigned = (flags & FLAG_UNSIGNED) != 0;
 	const bool isLE       = (flags & FLAG_LITTLE_ENDIAN) != 0;
@@ -111,3 +118,72 @@ AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte
 		MAKE_RAW_STREAM(false);
 	}
 }
+
+AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, bool disposeAfterUse) {
+	return makePCMStream(data, size, rate, channels, flags, disposeAfterUse, 0);
+}
+
+AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, BufferPool &pool) {
+	return makePCMStream(data, size, rate, channels, flags, true, &pool);
+}
+
+void unpack12BitSamples(int16 *dst, const byte *src, uint32 count) {
+	// Each pair is stored as v1, v2, v3, with the first sample made up of
+	// v1 and the low nibble of v2, and the second of v3 and the high nibble
+	// of v2. The 12-bit samples are unsigned.
+
+#ifdef __SSE2__
+	const __m128i lowMask = _mm_set1_epi32(0xFFF);
+	const __m128i highMask = _mm_set1_epi32(0xFF0000);
+	const __m128i nibbleMask = _mm_set1_epi32(0xF000000);
+	const __m128i signFlip = _mm_set1_epi16((short)0x8000);
+
+	// Four pairs at a time. The loads are 16 bytes for 12 bytes of data,
+	// so stop while there's room for that.
+	for (; count >= 6; count -= 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)src);
+
+		// Move each pair into its own 32-bit lane
+		__m128i pairs01 = _mm_unpacklo_epi32(in, _mm_srli_si128(in, 3));
+		__m128i pairs23 = _mm_unpacklo_epi32(_mm_srli_si128(in, 6), _mm_srli_si128(in, 9));
+		__m128i pairs = _mm_unpacklo_epi64(pairs01, pairs23);
+
+		// Put the first sample in the low 12 bits and the second in bits
+		// 16-27, then shift both up to 16 bits and make them signed
+		__m128i first = _mm_and_si128(pairs, lowMask);
+		__m128i second = _mm_or_si128(_mm_and_si128(pairs, highMask), _mm_and_si128(_mm_slli_epi32(pairs, 12), nibbleMask));
+		__m128i out = _mm_slli_epi16(_mm_or_si128(first, second), 4);
+
+		_mm_storeu_si128((__m128i *)dst, _mm_xor_si128(out, signFlip));
+		src += 12;
+		dst += 8;
+	}
+#endif
+
+	while (count--) {
+		byte v1 = *src++;
+		byte v2 = *src++;
+		byte v3 = *src++;
+		*dst++ = ((((v2 & 0xF) << 8) | v1) << 4) - 0x8000;
+		*dst++ = ((((v2 & 0xF0) << 4) | v3) << 4) - 0x8000;
+	}
+}
+
+void convertUnsigned8BitSamples(int16 *dst, const byte *src, uint32 count) {
+#ifdef __SSE2__
+	const __m128i signFlip = _mm_set1_epi8((char)0x80);
+
+	for (; count >= 16; count -= 16) {
+		// Flipping the top bit makes the samples signed, and unpacking
+		// them into the high byte of each word scales them up to 16 bits
+		__m128i in = _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), signFlip);
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(_mm_setzero_si128(), in));
+		_mm_storeu_si128((__m128i *)(dst + 8), _mm_unpackhi_epi8(_mm_setzero_si128(), in));
+		src += 16;
+		dst += 16;
+	}
+#endif
+
+	while (count--)
+		*dst++ = (int16)((*src++ ^ 0x80) << 8);
+}
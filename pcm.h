@@ -50,6 +50,7 @@ enum PCMFlags {
 };
 
 class AudioStream;
+class BufferPool;
 
 /**
  * Creates an audio stream, which plays from the given stream.
@@ -65,4 +66,19 @@ class AudioStream;
  */
 AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, bool disposeAfterUse = true);
 
+/**
+ * Creates an audio stream playing data from pool.acquire(), which is given
+ * back to the pool once the stream is deleted.
+ */
+AudioStream *makePCMStream(byte *data, uint32 size, int rate, int channels, byte flags, BufferPool &pool);
+
+/**
+ * Unpack count pairs of 12-bit samples, packed into three bytes each as
+ * iMuse does, to native endian signed 16-bit samples.
+ */
+void unpack12BitSamples(int16 *dst, const byte *src, uint32 count);
+
+/** Convert count unsigned 8-bit samples to native endian signed 16-bit */
+void convertUnsigned8BitSamples(int16 *dst, const byte *src, uint32 count);
+
 #endif
@@ -0,0 +1,248 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "scaler.h"
+
+void convertIndexLine(uint32 *dst, const byte *src, int width, const uint32 *lut) {
+	// There's no gather before AVX2, and even there it's no quicker than
+	// separate loads, so this is an unrolled lookup loop. Storing eight
+	// pixels at a time keeps the loads and stores independent.
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		uint32 p0 = lut[src[x + 0]], p1 = lut[src[x + 1]], p2 = lut[src[x + 2]], p3 = lut[src[x + 3]];
+		uint32 p4 = lut[src[x + 4]], p5 = lut[src[x + 5]], p6 = lut[src[x + 6]], p7 = lut[src[x + 7]];
+		dst[x + 0] = p0; dst[x + 1] = p1; dst[x + 2] = p2; dst[x + 3] = p3;
+		dst[x + 4] = p4; dst[x + 5] = p5; dst[x + 6] = p6; dst[x + 7] = p7;
+	}
+
+	for (; x < width; x++)
+		dst[x] = lut[src[x]];
+}
+
+// The nearest scalers look each pixel up once and store it several times
+static void scaleLineNearest2x(uint32 *dst, const byte *src, int width, const uint32 *lut) {
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x + 4 <= width; x += 4) {
+		__m128i pixels = _mm_set_epi32((int)lut[src[x + 3]], (int)lut[src[x + 2]], (int)lut[src[x + 1]], (int)lut[src[x]]);
+		_mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi32(pixels, pixels));
+		_mm_storeu_si128((__m128i *)(dst + x * 2 + 4), _mm_unpackhi_epi32(pixels, pixels));
+	}
+#endif
+
+	for (; x < width; x++) {
+		uint32 pixel = lut[src[x]];
+		dst[x * 2] = pixel;
+		dst[x * 2 + 1] = pixel;
+	}
+}
+
+static void scaleLineNearest3x(uint32 *dst, const byte *src, int width, const uint32 *lut) {
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x + 4 <= width; x += 4) {
+		__m128i pixels = _mm_set_epi32((int)lut[src[x + 3]], (int)lut[src[x + 2]], (int)lut[src[x + 1]], (int)lut[src[x]]);
+		_mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 0, 0, 0)));
+		_mm_storeu_si128((__m128i *)(dst + x * 3 + 4), _mm_shuffle_epi32(pixels, _MM_SHUFFLE(2, 2, 1, 1)));
+		_mm_storeu_si128((__m128i *)(dst + x * 3 + 8), _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 2)));
+	}
+#endif
+
+	for (; x < width; x++) {
+		uint32 pixel = lut[src[x]];
+		dst[x * 3] = pixel;
+		dst[x * 3 + 1] = pixel;
+		dst[x * 3 + 2] = pixel;
+	}
+}
+
+static inline void smoothPixel2x(byte *dst, byte b, byte d, byte e, byte f, byte h) {
+	dst[0] = (d == b && b != f && d != h) ? d : e;
+	dst[1] = (b == f && b != d && f != h) ? f : e;
+}
+
+// One output line of Scale2x, on palette indices. For the second output
+// line of a source line, pass above and below swapped: that mirrors the
+// rules vertically.
+static void smoothLine2x(byte *dst, const byte *above, const byte *src, const byte *below, int width) {
+	if (width == 1) {
+		dst[0] = dst[1] = src[0];
+		return;
+	}
+
+	// The frame edges use the edge pixel as its own neighbour
+	smoothPixel2x(dst, above[0], src[0], src[0], src[1], below[0]);
+	int x = 1;
+
+#ifdef __SSE2__
+	for (; x + 17 <= width; x += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(above + x));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + x - 1));
+		__m128i e = _mm_loadu_si128((const __m128i *)(src + x));
+		__m128i f = _mm_loadu_si128((const __m128i *)(src + x + 1));
+		__m128i h = _mm_loadu_si128((const __m128i *)(below + x));
+
+		__m128i db = _mm_cmpeq_epi8(d, b);
+		__m128i bf = _mm_cmpeq_epi8(b, f);
+		__m128i dh = _mm_cmpeq_epi8(d, h);
+		__m128i fh = _mm_cmpeq_epi8(f, h);
+
+		__m128i mask0 = _mm_andnot_si128(_mm_or_si128(bf, dh), db);
+		__m128i mask1 = _mm_andnot_si128(_mm_or_si128(db, fh), bf);
+		__m128i e0 = _mm_or_si128(_mm_and_si128(mask0, d), _mm_andnot_si128(mask0, e));
+		__m128i e1 = _mm_or_si128(_mm_and_si128(mask1, f), _mm_andnot_si128(mask1, e));
+
+		_mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi8(e0, e1));
+		_mm_storeu_si128((__m128i *)(dst + x * 2 + 16), _mm_unpackhi_epi8(e0, e1));
+	}
+#endif
+
+	for (; x < width - 1; x++)
+		smoothPixel2x(dst + x * 2, above[x], src[x - 1], src[x], src[x + 1], below[x]);
+
+	smoothPixel2x(dst + x * 2, above[x], src[x - 1], src[x], src[x], below[x]);
+}
+
+Scaler::Scaler() : _mode(kModeNone), _aspectRatio(false), _buffers(1) {
+}
+
+void Scaler::setBufferCount(int count) {
+	if ((int)_buffers.size() < count)
+		_buffers.resize(count);
+}
+
+void Scaler::setMode(Mode mode, bool aspectRatio) {
+	_mode = mode;
+	_aspectRatio = aspectRatio;
+}
+
+int Scaler::getFactor() const {
+	switch (_mode) {
+	case kModeNearest2x:
+	case kModeSmooth2x:
+		return 2;
+	case kModeNearest3x:
+		return 3;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+int Scaler::getScaledHeight(int height) const {
+	height *= getFactor();
+
+	if (_aspectRatio)
+		height = height * 6 / 5;
+
+	return height;
+}
+
+Rect Scaler::getOutputRect(const Rect &rect, int width, int height) const {
+	Rect r = rect;
+
+	// Scale2x output depends on the neighbouring pixels too
+	if (_mode == kModeSmooth2x) {
+		r.left--;
+		r.top--;
+		r.right++;
+		r.bottom++;
+	}
+
+	r.clip(width, height);
+
+	// Output line y shows scaled line y * scaledHeight / outHeight, so
+	// round the edges up to get every line that maps into the rect
+	int factor = getFactor();
+	int scaledHeight = height * factor;
+	int outHeight = getScaledHeight(height);
+	int top = (r.top * factor * outHeight + scaledHeight - 1) / scaledHeight;
+	int bottom = (r.bottom * factor * outHeight + scaledHeight - 1) / scaledHeight;
+
+	return Rect(r.left * factor, top, r.right * factor, bottom);
+}
+
+void Scaler::scale(byte *dst, int dstPitch, const Rect &outRect, const byte *src, int srcPitch, int width, int height, const uint32 *lut, int buffer) {
+	int factor = getFactor();
+	int scaledHeight = height * factor;
+	int outHeight = getScaledHeight(height);
+	int lineWidth = width * factor;
+	int lastKey = -1;
+
+	// Lines are always scaled at full width, which keeps the edge handling
+	// in one place; they're short enough for that not to matter
+	std::vector<uint32> &outLine = _buffers[buffer].line;
+	std::vector<byte> &indexLine = _buffers[buffer].indexLine;
+	outLine.resize(lineWidth);
+
+	if (_mode == kModeSmooth2x)
+		indexLine.resize(lineWidth);
+
+	for (int y = outRect.top; y < outRect.bottom; y++) {
+		int line = y * scaledHeight / outHeight;
+		int srcY = line / factor;
+
+		// Only Scale2x makes different lines out of one source line, and
+		// aspect ratio correction repeats lines, so each is made only once
+		int key = (_mode == kModeSmooth2x) ? line : srcY;
+
+		if (key != lastKey) {
+			const byte *cur = src + srcY * srcPitch;
+
+			switch (_mode) {
+			case kModeNearest2x:
+				scaleLineNearest2x(&outLine[0], cur, width, lut);
+				break;
+			case kModeNearest3x:
+				scaleLineNearest3x(&outLine[0], cur, width, lut);
+				break;
+			case kModeSmooth2x: {
+				const byte *above = (srcY > 0) ? cur - srcPitch : cur;
+				const byte *below = (srcY < height - 1) ? cur + srcPitch : cur;
+
+				if (line & 1)
+					smoothLine2x(&indexLine[0], below, cur, above, width);
+				else
+					smoothLine2x(&indexLine[0], above, cur, below, width);
+
+				convertIndexLine(&outLine[0], &indexLine[0], lineWidth, lut);
+				break;
+			}
+			default:
+				convertIndexLine(&outLine[0], cur, width, lut);
+				break;
+			}
+
+			lastKey = key;
+		}
+
+		memcpy(dst + (y - outRect.top) * dstPitch, &outLine[outRect.left], outRect.width() * 4);
+	}
+}
@@ -0,0 +1,84 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <vector>
+
+#include "dirtyregion.h"
+#include "types.h"
+
+// Convert a line of palette indices through a packed palette table
+void convertIndexLine(uint32 *dst, const byte *src, int width, const uint32 *lut);
+
+/**
+ * Scales 8bpp frames on the CPU, converting them through the palette
+ * table on the way. Scaling works on palette indices, so the smoother
+ * only has to compare bytes, and each output line is converted once no
+ * matter how many times it's repeated.
+ */
+class Scaler {
+public:
+	enum Mode {
+		kModeNone,
+		kModeNearest2x,
+		kModeNearest3x,
+		kModeSmooth2x	// Scale2x/EPX
+	};
+
+	Scaler();
+
+	// Aspect ratio correction stretches 5 lines to 6, for 320x200 video
+	// meant for 4:3 displays
+	void setMode(Mode mode, bool aspectRatio);
+	bool isEnabled() const { return _mode != kModeNone || _aspectRatio; }
+	int getFactor() const;
+	int getScaledWidth(int width) const { return width * getFactor(); }
+	int getScaledHeight(int height) const;
+
+	/** The output rect that changes when rect in the source does */
+	Rect getOutputRect(const Rect &rect, int width, int height) const;
+
+	/**
+	 * Scale a width x height frame into the output rect from
+	 * getOutputRect(). dst points at the rect's top left corner.
+	 *
+	 * Calls with different buffers can run at the same time, on separate
+	 * parts of the output; setBufferCount() has to be called first.
+	 */
+	void scale(byte *dst, int dstPitch, const Rect &outRect, const byte *src, int srcPitch, int width, int height, const uint32 *lut, int buffer = 0);
+	void setBufferCount(int count);
+
+private:
+	// Scratch space for the line being scaled
+	struct LineBuffer {
+		std::vector<uint32> line;
+		std::vector<byte> indexLine;
+	};
+
+	Mode _mode;
+	bool _aspectRatio;
+	std::vector<LineBuffer> _buffers;
+};
+
+#endif
@@ -87,7 +87,6 @@ protected:
 private:
 	void readHeader();
 	void queueSamples();
-	void decode12(const byte *src, int16 *dst, uint32 size);
 
 	uint _bitsPerSample;
 	uint _rate;
@@ -21,14 +21,33 @@
  */
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <SDL.h>
 
 #include "audioman.h"
+#include "benchmark.h"
+#include "framepacer.h"
 #include "graphicsman.h"
 #include "smushvideo.h"
+#include "threadpool.h"
 
 void printUsage(const char *appName) {
-	printf("Usage: %s <video>\n", appName);
+	printf("Usage: %s [options] <video>\n", appName);
+	printf("       %s --benchmark <name>\n\n", appName);
+	printf("Options:\n");
+	printf("  --shadow-frame  Only convert the pixels that changed each frame (8bpp)\n");
+	printf("  --scaler <mode> Scale 8bpp video on the CPU: 2x, 3x or smooth2x\n");
+	printf("  --aspect        Stretch to a 4:3 aspect ratio (8bpp)\n");
+	printf("  --textures <n>  Rotate between n streaming textures (1-3, default 2)\n");
+	printf("  --timings       Print how long uploading and presenting took\n");
+	printf("  --vsync         Line presents up with the display's refresh\n");
+	printf("  --frame-report  Print when each frame was due and when it was shown\n");
+	printf("  --check-states <n>\n");
+	printf("                  Check that decoding on from a state saved every n frames\n");
+	printf("                  matches, instead of playing the video\n\n");
+	printf("Benchmarks:\n");
+	listBenchmarks();
 }
 
 #define SMUSHPLAY_VERSION "0.0.1"
@@ -45,7 +64,76 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
-	if ( SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0 ) {
+	if ( !strcmp(argv[1], "--benchmark") ) {
+		if ( argc < 3 || !runBenchmark(argv[2]) ) {
+			printUsage(argv[0]);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	const char *fileName = 0;
+	bool shadowFrame = false;
+	bool timings = false;
+	bool vsync = false;
+	bool frameReport = false;
+	bool aspectRatio = false;
+	Scaler::Mode scaleMode = Scaler::kModeNone;
+	int textureCount = 2;
+	int checkInterval = 0;
+
+	for ( int i = 1; i < argc; i++ ) {
+		if ( !strcmp(argv[i], "--shadow-frame") ) {
+			shadowFrame = true;
+		} else if ( !strcmp(argv[i], "--scaler") && i + 1 < argc ) {
+			i++;
+
+			if ( !strcmp(argv[i], "2x") ) {
+				scaleMode = Scaler::kModeNearest2x;
+			} else if ( !strcmp(argv[i], "3x") ) {
+				scaleMode = Scaler::kModeNearest3x;
+			} else if ( !strcmp(argv[i], "smooth2x") ) {
+				scaleMode = Scaler::kModeSmooth2x;
+			} else {
+				fprintf(stderr, "Unknown scaler '%s'\n", argv[i]);
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if ( !strcmp(argv[i], "--aspect") ) {
+			aspectRatio = true;
+		} else if ( !strcmp(argv[i], "--textures") && i + 1 < argc ) {
+			textureCount = atoi(argv[++i]);
+		} else if ( !strcmp(argv[i], "--timings") ) {
+			timings = true;
+		} else if ( !strcmp(argv[i], "--vsync") ) {
+			vsync = true;
+		} else if ( !strcmp(argv[i], "--frame-report") ) {
+			frameReport = true;
+		} else if ( !strcmp(argv[i], "--check-states") && i + 1 < argc ) {
+			checkInterval = atoi(argv[++i]);
+
+			if ( checkInterval <= 0 ) {
+				fprintf(stderr, "Bad state interval '%s'\n", argv[i]);
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if ( argv[i][0] == '-' && argv[i][1] == '-' ) {
+			fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+			printUsage(argv[0]);
+			return 1;
+		} else {
+			fileName = argv[i];
+		}
+	}
+
+	if ( !fileName ) {
+		printUsage(argv[0]);
+		return 0;
+	}
+
+	// Checking states draws offscreen, so it doesn't need a display
+	if ( SDL_Init(checkInterval ? SDL_INIT_AUDIO : SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0 ) {
 		fprintf(stderr, "Failed to initialize SDL\n");
 		return 1;
 	}
@@ -60,11 +148,29 @@ int main(int argc, char **argv) {
 	}
 
 	SMUSHVideo video(audio);
-	if ( !video.load(argv[1]) ) {
-		fprintf(stderr, "Failed to play file '%s'\n", argv[1]);
+	if ( !video.load(fileName) ) {
+		fprintf(stderr, "Failed to play file '%s'\n", fileName);
 		return 1;
 	}
 
+	// Decoding and converting take turns, so they share the one pool
+	ThreadPool threadPool;
+	video.setThreadPool(&threadPool);
+
+	if ( checkInterval ) {
+		// Frames get decoded twice, so keep the audio quiet
+		SDL_PauseAudio(1);
+
+		GraphicsManager gfx;
+		gfx.setThreadPool(&threadPool);
+		if ( !gfx.initOffscreen(video.getWidth(), video.getHeight(), video.isHighColor()) ) {
+			fprintf(stderr, "Failed to initialize the offscreen renderer\n");
+			return 1;
+		}
+
+		return video.checkStates(gfx, checkInterval) ? 0 : 1;
+	}
+
 	SDL_Window *window = SDL_CreateWindow("smushplay", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, video.getWidth(), video.getHeight(), SDL_WINDOW_SHOWN);
 	if ( !window ) {
 		fprintf(stderr, "Failed to initialize SDL screen\n");
@@ -72,14 +178,30 @@ int main(int argc, char **argv) {
 	}
 
 	GraphicsManager gfx;
+	gfx.setScaler(scaleMode, aspectRatio);
+	gfx.setTextureCount(textureCount);
+	gfx.setVSync(vsync);
+	gfx.setThreadPool(&threadPool);
 	if ( !gfx.init(window, video.getWidth(), video.getHeight(), video.isHighColor()) ) {
 		fprintf(stderr, "Failed to initialize SDL screen\n");
 		SDL_DestroyWindow(window);
 		return 1;
 	}
 
+	gfx.setShadowFrame(shadowFrame);
+
+	if ( vsync && !gfx.hasVSync() )
+		fprintf(stderr, "The renderer doesn't support vsync\n");
+
 	// Finally, play the damned thing
-	video.play(gfx);
+	FramePacer pacer;
+	video.play(gfx, pacer);
+
+	if ( timings )
+		gfx.printTimings();
+
+	if ( frameReport )
+		pacer.printReport();
 
 	SDL_DestroyWindow(window);
 	return 0;
@@ -28,14 +28,19 @@
 #include <zlib.h>
 #include "audioman.h"
 #include "audiostream.h"
+#include "blitters.h"
 #include "blocky16.h"
 #include "codec37.h"
 #include "codec47.h"
 #include "codec48.h"
+#include "framebuffer.h"
+#include "framepacer.h"
+#include "iact.h"
 #include "pcm.h"
 #include "smushchannel.h"
 #include "smushvideo.h"
 #include "stream.h"
+#include "threadpool.h"
 #include "util.h"
 #include "vima.h"
 
@@ -63,19 +68,25 @@
 
 SMUSHVideo::SMUSHVideo(AudioManager &audio) : _audio(&audio) {
 	_file = 0;
-	_buffer = _storedFrame = 0;
+	_buffer = 0;
 	_storeFrame = false;
+	_fetchPending = false;
+	_fetchX = _fetchY = 0;
+	_presentFrame = true;
+	_skippedCodec = 0;
+	_bufferCodec = 0;
 	_codec37 = 0;
 	_codec47 = 0;
 	_codec48 = 0;
 	_blocky16 = 0;
+	_threadPool = 0;
 	_runSoundHeaderCheck = false;
 	_ranIACTSoundCheck = false;
 	_audioChannels = 0;
 	_width = _height = 0;
 	_iactStream = 0;
-	_iactBuffer = 0;
-	_vimaDestTable = 0;
+	_iactPos = 0;
+	_curFrame = 0;
 	_frameRate = 0;
 	_audioRate = 0;
 }
@@ -138,11 +149,13 @@ void SMUSHVideo::close() {
 		delete _file;
 		_file = 0;
 
-		delete[] _buffer;
+		freeFrameBuffer(_buffer);
 		_buffer = 0;
 
-		delete[] _storedFrame;
-		_storedFrame = 0;
+		_frameStore.clear();
+		_skippedCodec = 0;
+		_dirtyRegion.clear();
+		_bufferCodec = 0;
 
 		delete _codec37;
 		_codec37 = 0;
@@ -158,15 +171,14 @@ void SMUSHVideo::close() {
 
 		_iactStream = 0;
 
-		delete[] _iactBuffer;
-		_iactBuffer = 0;
-
-		delete[] _vimaDestTable;
-		_vimaDestTable = 0;
+		_iactBuffer.clear();
+		_iactPos = 0;
 
 		_runSoundHeaderCheck = false;
 		_ranIACTSoundCheck = false;
 		_storeFrame = false;
+		_fetchPending = false;
+		_curFrame = 0;
 		_audioChannels = 0;
 		_width = _height = 0;
 		_frameRate = 0;
@@ -191,16 +203,16 @@ uint SMUSHVideo::getHeight() const {
 	return _height;
 }
 
-uint32 SMUSHVideo::getNextFrameTime(uint32 curFrame) const {
-	// SANM stores the frame rate as time between frames
+int64 SMUSHVideo::getFrameTime(uint32 frame) const {
+	// SANM stores the frame rate as microseconds between frames
 	if (_mainTag == MKTAG('S', 'A', 'N', 'M'))
-		return curFrame * _frameRate / 1000;
+		return (int64)frame * _frameRate;
 
 	// Otherwise, in terms of frames per second
-	return curFrame * 1000 / _frameRate;
+	return (int64)frame * 1000000 / _frameRate;
 }
 
-void SMUSHVideo::play(GraphicsManager &gfx) {
+void SMUSHVideo::play(GraphicsManager &gfx, FramePacer &pacer) {
 	if (!isLoaded())
 		return;
 
@@ -208,31 +220,289 @@ void SMUSHVideo::play(GraphicsManager &gfx) {
 	if (!isHighColor())
 		gfx.setPalette(_palette, 0, 256);
 
-	uint32 startTime = SDL_GetTicks();
-	uint curFrame = 0;
+	pacer.start(gfx.hasVSync() ? gfx.getRefreshRate() : 0);
 
-	while (curFrame < _frameCount) {
-		if (SDL_GetTicks() > startTime + getNextFrameTime(curFrame)) {
-			if (!handleFrame(gfx)) {
-				fprintf(stderr, "Problem during frame decode\n");
-				return;
-			}
+	// Playback carries on from wherever a loaded state left off, so time
+	// is counted from that frame
+	int64 startTime = getFrameTime(_curFrame);
+
+	// Each frame is decoded as soon as the last one is up, and then held
+	// back until it's due
+	while (_curFrame < _frameCount) {
+		uint curFrame = _curFrame;
+		int64 dueTime = getFrameTime(curFrame) - startTime;
+
+		// If we're so far behind that the next frame is due as well,
+		// don't bother showing this one
+		bool present = curFrame + 1 == _frameCount || pacer.getTime() <= getFrameTime(curFrame + 1) - startTime;
+
+		if (!handleFrame(gfx, present)) {
+			fprintf(stderr, "Problem during frame decode\n");
+			return;
+		}
 
-			gfx.update();
-			curFrame++;
+		if (present) {
+			pacer.waitForPresent(dueTime);
+
+			if (gfx.update())
+				pacer.framePresented(curFrame, dueTime);
+			else
+				pacer.frameUnchanged();
+		} else {
+			pacer.frameSkipped();
 		}
 
 		SDL_Event event;
-		while (SDL_PollEvent(&event))
+		while (SDL_PollEvent(&event)) {
 			if (event.type == SDL_QUIT)
 				return;
 
-		SDL_Delay(10);
+			// Unchanged frames aren't presented, so redraw if the window
+			// needs it
+			if (event.type == SDL_WINDOWEVENT)
+				gfx.invalidate();
+		}
 	}
 
 	printf("Done!\n");
 }
 
+struct SMUSHCodecState {
+	uint32 size; // 0 if the codec wasn't in use
+	int32 width, height;
+};
+
+// The state is this header, followed by the palettes, the frame buffer,
+// the stored frame, the state of each codec in use and then the part of
+// an IACT audio block read so far
+struct SMUSHVideoState {
+	int32 filePos;
+	uint32 curFrame;
+	uint32 iactPos;
+	uint32 width, height, pitch;
+	byte hasBuffer, storeFrame;
+	uint32 frameStoreSize;
+	SMUSHCodecState codec37, codec47, codec48, blocky16;
+};
+
+template<class Codec>
+static void getCodecState(const Codec *codec, SMUSHCodecState &state) {
+	state.size = codec ? codec->getStateSize() : 0;
+	state.width = codec ? codec->getWidth() : 0;
+	state.height = codec ? codec->getHeight() : 0;
+}
+
+template<class Codec>
+static byte *saveCodecState(const Codec *codec, const SMUSHCodecState &state, byte *dst) {
+	if (codec)
+		codec->saveState(dst);
+
+	return dst + state.size;
+}
+
+template<class Codec>
+static const byte *loadCodecState(Codec *&codec, const SMUSHCodecState &state, const byte *src) {
+	// A codec that wasn't in use yet has to start out fresh again
+	if (codec && (state.size == 0 || codec->getWidth() != state.width || codec->getHeight() != state.height)) {
+		delete codec;
+		codec = 0;
+	}
+
+	if (state.size == 0)
+		return src;
+
+	if (!codec)
+		codec = new Codec(state.width, state.height);
+
+	codec->loadState(src);
+	return src + state.size;
+}
+
+void SMUSHVideo::saveState(State &state) const {
+	state.clear();
+
+	if (!isLoaded())
+		return;
+
+	SMUSHVideoState header;
+	header.filePos = _file->pos();
+	header.curFrame = _curFrame;
+	header.iactPos = _iactPos;
+	header.width = _width;
+	header.height = _height;
+	header.pitch = _pitch;
+	header.hasBuffer = _buffer != 0;
+	header.storeFrame = _storeFrame;
+	header.frameStoreSize = _frameStore.getStateSize();
+	getCodecState(_codec37, header.codec37);
+	getCodecState(_codec47, header.codec47);
+	getCodecState(_codec48, header.codec48);
+	getCodecState(_blocky16, header.blocky16);
+
+	uint32 frameSize = _pitch * _height;
+	state.resize(sizeof(header) + sizeof(_palette) + sizeof(_deltaPalette)
+			+ header.hasBuffer * frameSize + header.frameStoreSize
+			+ header.codec37.size + header.codec47.size + header.codec48.size + header.blocky16.size
+			+ header.iactPos);
+
+	byte *dst = &state[0];
+	memcpy(dst, &header, sizeof(header));
+	dst += sizeof(header);
+	memcpy(dst, _palette, sizeof(_palette));
+	dst += sizeof(_palette);
+	memcpy(dst, _deltaPalette, sizeof(_deltaPalette));
+	dst += sizeof(_deltaPalette);
+
+	if (_buffer) {
+		if (_skippedCodec)
+			copySkippedFrame(dst);
+		else
+			memcpy(dst, _buffer, frameSize);
+
+		dst += frameSize;
+	}
+
+	_frameStore.saveState(dst);
+	dst += header.frameStoreSize;
+
+	dst = saveCodecState(_codec37, header.codec37, dst);
+	dst = saveCodecState(_codec47, header.codec47, dst);
+	dst = saveCodecState(_codec48, header.codec48, dst);
+	dst = saveCodecState(_blocky16, header.blocky16, dst);
+
+	if (_iactPos)
+		memcpy(dst, _iactBuffer.data(), _iactPos);
+}
+
+bool SMUSHVideo::loadState(GraphicsManager &gfx, const State &state) {
+	if (!isLoaded() || state.size() < sizeof(SMUSHVideoState))
+		return false;
+
+	SMUSHVideoState header;
+	memcpy(&header, &state[0], sizeof(header));
+
+	if (header.width != _width || header.height != _height || header.pitch != _pitch)
+		return false;
+
+	uint32 frameSize = _pitch * _height;
+	uint32 size = sizeof(header) + sizeof(_palette) + sizeof(_deltaPalette)
+			+ header.hasBuffer * frameSize + header.frameStoreSize
+			+ header.codec37.size + header.codec47.size + header.codec48.size + header.blocky16.size
+			+ header.iactPos;
+
+	if (header.curFrame > _frameCount || state.size() != size)
+		return false;
+
+	const byte *src = &state[0] + sizeof(header);
+	memcpy(_palette, src, sizeof(_palette));
+	src += sizeof(_palette);
+	memcpy(_deltaPalette, src, sizeof(_deltaPalette));
+	src += sizeof(_deltaPalette);
+
+	_skippedCodec = 0;
+	_fetchPending = false;
+	_dirtyRegion.addAll();
+	_bufferCodec = 0;
+
+	if (header.hasBuffer) {
+		if (!_buffer)
+			_buffer = allocFrameBuffer(frameSize);
+
+		memcpy(_buffer, src, frameSize);
+		src += frameSize;
+	} else {
+		freeFrameBuffer(_buffer);
+		_buffer = 0;
+	}
+
+	_frameStore.loadState(src);
+	src += header.frameStoreSize;
+	_storeFrame = header.storeFrame != 0;
+
+	src = loadCodecState(_codec37, header.codec37, src);
+	src = loadCodecState(_codec47, header.codec47, src);
+	src = loadCodecState(_codec48, header.codec48, src);
+	src = loadCodecState(_blocky16, header.blocky16, src);
+
+	if (_iactBuffer.size() < header.iactPos)
+		_iactBuffer.resize(header.iactPos);
+
+	if (header.iactPos)
+		memcpy(_iactBuffer.data(), src, header.iactPos);
+
+	_iactPos = header.iactPos;
+	_curFrame = header.curFrame;
+	_file->seek(header.filePos, SEEK_SET);
+
+	if (!isHighColor())
+		gfx.setPalette(_palette, 0, 256);
+
+	return true;
+}
+
+bool SMUSHVideo::decodeFrames(GraphicsManager &gfx, uint count, std::vector<byte> &frame) {
+	for (uint i = 0; i < count && _curFrame < _frameCount; i++)
+		if (!handleFrame(gfx))
+			return false;
+
+	// Every frame was presented, so the buffer is up to date
+	if (_buffer)
+		frame.assign(_buffer, _buffer + _pitch * _height);
+	else
+		frame.clear();
+
+	return true;
+}
+
+bool SMUSHVideo::checkStates(GraphicsManager &gfx, uint interval) {
+	if (!isLoaded() || interval == 0)
+		return false;
+
+	if (!isHighColor())
+		gfx.setPalette(_palette, 0, 256);
+
+	// Save a state, decode a few frames, then go back to the state and
+	// decode them again. Both runs have to end on the same frame.
+	State state;
+	std::vector<byte> expected, actual;
+
+	while (_curFrame < _frameCount) {
+		uint startFrame = _curFrame;
+		saveState(state);
+
+		if (!decodeFrames(gfx, interval, expected)) {
+			fprintf(stderr, "Problem during frame decode\n");
+			return false;
+		}
+
+		uint endFrame = _curFrame;
+		int32 endPos = _file->pos();
+
+		if (!loadState(gfx, state) || _curFrame != startFrame) {
+			fprintf(stderr, "Failed to load the state at frame %d\n", startFrame);
+			return false;
+		}
+
+		if (!decodeFrames(gfx, interval, actual)) {
+			fprintf(stderr, "Problem during frame decode\n");
+			return false;
+		}
+
+		if (_curFrame != endFrame || _file->pos() != endPos) {
+			fprintf(stderr, "Decoding from the state at frame %d ended at frame %d instead of %d\n", startFrame, _curFrame, endFrame);
+			return false;
+		}
+
+		if (actual != expected) {
+			fprintf(stderr, "Frame %d differs after loading the state at frame %d\n", endFrame - 1, startFrame);
+			return false;
+		}
+	}
+
+	printf("States match at every %d frames\n", interval);
+	return true;
+}
+
 bool SMUSHVideo::readHeader() {
 	uint32 tag = _file->readUint32BE();
 	uint32 size = _file->readUint32BE();
@@ -286,7 +556,9 @@ bool SMUSHVideo::readHeader() {
 	return false;
 }
 
-bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
+bool SMUSHVideo::handleFrame(GraphicsManager &gfx, bool present) {
+	_presentFrame = present;
+
 	uint32 tag = _file->readUint32BE();
 	uint32 size = _file->readUint32BE();
 	uint32 pos = _file->pos();
@@ -320,13 +592,13 @@ bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
 
 		switch (subType) {
 		case MKTAG('B', 'l', '1', '6'):
-			result = handleBlocky16(gfx, subSize);
+			result = handleBlocky16(subSize);
 			break;
 		case MKTAG('F', 'A', 'D', 'E'):
 			// TODO: Seems to not be needed as XPAL is used in v1 instead?
 			break;
 		case MKTAG('F', 'O', 'B', 'J'):
-			result = handleFrameObject(gfx, subSize);
+			result = handleFrameObject(subSize);
 			break;
 		case MKTAG('F', 'T', 'C', 'H'):
 			result = handleFetch(subSize);
@@ -375,7 +647,7 @@ bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
 			break;
 		case MKTAG('Z', 'F', 'O', 'B'):
 			// Zipped Frame Object (ScummVM-compressed)
-			result = handleZlibFrameObject(gfx, subSize);
+			result = handleZlibFrameObject(subSize);
 			break;
 		default:
 			// TODO: Other types
@@ -389,10 +661,52 @@ bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
 		_file->seek(subPos + subSize + (subSize & 1), SEEK_SET);
 	}
 
+	// Everything in the frame has been drawn, so upload it once. A FTCH
+	// after the last frame object restores the background for the next
+	// frame, so that's only applied afterwards.
+	if (present && _buffer) {
+		flushSkippedFrame();
+		blitBuffer(gfx);
+	}
+
+	applyPendingFetch();
+
 	_file->seek(pos + size + (size & 1), SEEK_SET);
+	_curFrame++;
 	return true;
 }
 
+void SMUSHVideo::blitBuffer(GraphicsManager &gfx) {
+	gfx.blit(_buffer, _pitch, _dirtyRegion);
+	_dirtyRegion.clear();
+}
+
+void SMUSHVideo::copySkippedFrame(byte *dst) const {
+	switch (_skippedCodec) {
+	case 16:
+		_blocky16->copyFrame(dst);
+		break;
+	case 37:
+		_codec37->copyFrame(dst);
+		break;
+	case 47:
+		_codec47->copyFrame(dst);
+		break;
+	case 48:
+		_codec48->copyFrame(dst);
+		break;
+	}
+}
+
+void SMUSHVideo::flushSkippedFrame() {
+	if (!_skippedCodec)
+		return;
+
+	_frameStore.prepareWrite(_buffer);
+	copySkippedFrame(_buffer);
+	_skippedCodec = 0;
+}
+
 bool SMUSHVideo::handleNewPalette(GraphicsManager &gfx, uint32 size) {
 	// Load a new palette
 
@@ -446,22 +760,22 @@ bool SMUSHVideo::handleDeltaPalette(GraphicsManager &gfx, uint32 size) {
 	return false;
 }
 
-bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, uint32 size) {
-	return handleFrameObject(gfx, _file, size);
+bool SMUSHVideo::handleFrameObject(uint32 size) {
+	return handleFrameObject(_file, size);
 }
 
-bool SMUSHVideo::handleZlibFrameObject(GraphicsManager &gfx, uint32 size) {
+bool SMUSHVideo::handleZlibFrameObject(uint32 size) {
 	SeekableReadStream *stream = decompressZlibFrameObject(size);
 
 	if (!stream)
 		return false;
 
-	bool result = handleFrameObject(gfx, stream, stream->size());
+	bool result = handleFrameObject(stream, stream->size());
 	delete stream;
 	return result;
 }
 
-bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *stream, uint32 size) {
+bool SMUSHVideo::handleFrameObject(SeekableReadStream *stream, uint32 size) {
 	// Decode a frame object
 
 	if (isHighColor()) {
@@ -491,16 +805,32 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 			return true;
 		}
 	} else if (left < 0 || top < 0 || left + width > (int)_width || top + height > (int)_height) {
+		if (_storeFrame && getLineDecoder(codec)) {
+			applyPendingFetch();
+			return storeLargeFrameObject(stream, codec, left, top, width, height, size);
+		}
+
 		// TODO: We should be drawing partial frames
 		fprintf(stderr, "Bad codec %d coordinates %d, %d, %d, %d\n", codec, left, top, width, height);
 		return true;
 	}
 
+	applyPendingFetch();
+
+	// Everything but the full frame codecs draws on top of the last frame
+	if (codec != 37 && codec != 47 && codec != 48)
+		flushSkippedFrame();
+
+	_frameStore.prepareWrite(_buffer);
+
 	switch (codec) {
 	case 1:
-	case 3:
-		decodeCodec1(stream, left, top, width, height);
-		break;
+	case 3: {
+		byte *ptr = new byte[size];
+		stream->read(ptr, size);
+		decodeLines(decodeCodec1Line, ptr, size, _buffer + top * _pitch + left, _pitch, width, height);
+		delete[] ptr;
+		} break;
 	case 2:
 		// TODO: Used by Rebel Assault
 		// Think it's basically codec1
@@ -514,21 +844,30 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		// TODO: Used by Rebel Assault
 		printf("Unhandled codec 5 frame object\n");
 		break;
-	case 21:
+	case 21: {
 	//case 44:
-		decodeCodec21(stream, left, top, width, height);
-		break;
+		byte *ptr = new byte[size];
+		stream->read(ptr, size);
+		decodeLines(decodeCodec21Line, ptr, size, _buffer + top * _pitch + left, _pitch, width, height);
+		delete[] ptr;
+		} break;
 	case 23:
 		// TODO: Used by Rebel Assault, Rebel Assault II, and Mortimer
 		// Used for the blue transparent overlays
 		printf("Unhandled codec 23 frame object\n");
 		break;
-	case 31:
-		decodeCodec31(stream, left, top, width, height);
-		break;
-	case 32:
-		decodeCodec32(stream, left, top, width, height);
-		break;
+	case 31: {
+		byte *ptr = new byte[size];
+		stream->read(ptr, size);
+		decodeLines(decodeCodec31Line, ptr, size, _buffer + top * _pitch + left, _pitch, width, height);
+		delete[] ptr;
+		} break;
+	case 32: {
+		byte *ptr = new byte[size];
+		stream->read(ptr, size);
+		decodeLines(decodeCodec32Line, ptr, size, _buffer + top * _pitch + left, _pitch, width, height);
+		delete[] ptr;
+		} break;
 	case 33:
 		// TODO: Used by Rebel Assault Sega CD
 		printf("Unhandled codec 33 frame object\n");
@@ -544,7 +883,8 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		if (!_codec37)
 			_codec37 = new Codec37Decoder(width, height);
 
-		_codec37->decode(_buffer, ptr);
+		_codec37->decode(_presentFrame ? _buffer : 0, ptr, size);
+		_skippedCodec = _presentFrame ? 0 : 37;
 		delete[] ptr;
 		} break;
 	case 45:
@@ -559,7 +899,8 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		if (!_codec47)
 			_codec47 = new Codec47Decoder(width, height);
 
-		_codec47->decode(_buffer, ptr);
+		_codec47->decode(_presentFrame ? _buffer : 0, ptr, size);
+		_skippedCodec = _presentFrame ? 0 : 47;
 		delete[] ptr;
 		} break;
 	case 48: {
@@ -571,7 +912,8 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		if (!_codec48)
 			_codec48 = new Codec48Decoder(width, height);
 
-		_codec48->decode(_buffer, ptr);
+		_codec48->decode(_presentFrame ? _buffer : 0, ptr, size);
+		_skippedCodec = _presentFrame ? 0 : 48;
 		delete[] ptr;
 		} break;
 	default:
@@ -582,28 +924,46 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		break;
 	}
 
-	if (_storeFrame) {
-		if (!_storedFrame)
-			_storedFrame = new byte[_pitch * _height];
+	if (codec == 47) {
+		// Codec 47 knows which blocks it changed, as long as nothing was
+		// drawn over its last frame
+		if (_bufferCodec == 47)
+			_dirtyRegion.add(_codec47->getDirtyRegion());
+		else
+			_dirtyRegion.addAll();
+
+		_bufferCodec = 47;
+	} else if (codec == 37 || codec == 48) {
+		_dirtyRegion.addAll();
+		_bufferCodec = 0;
+	} else if (getLineDecoder(codec)) {
+		_dirtyRegion.addRect(Rect(left, top, left + width, top + height));
+		_bufferCodec = 0;
+	}
 
-		memcpy(_storedFrame, _buffer, _pitch * _height);
+	if (_storeFrame) {
+		flushSkippedFrame();
+		_frameStore.storeFrame(_buffer, _width, _height, _pitch);
 		_storeFrame = false;
 	}
 
-	// Ideally, this call should be at the end of the FRME block, but it
-	// seems that breaks things like the video in Rebel Assault of Cmdr.
-	// Farrell coming in to save you.
-	gfx.blit(_buffer, 0, 0, _width, _height, _pitch);
 	return true;
 }
 
 bool SMUSHVideo::handleStore(uint32 size) {
 	// Store the next frame object
-	// TODO: There's definitely a mechanism to grab more than just what's on
-	// the screen. RA's L3INTRO.ANM draws overlarge frames, then expects to
-	// later restore them, while moving them.
+	// RA's L3INTRO.ANM draws overlarge frames, then expects to later restore
+	// them, while moving them. See storeLargeFrameObject().
 	_storeFrame = true;
-	return size >= 4;
+
+	if (size < 4)
+		return false;
+
+	// This looks like it could pick where to store it, but only zero has
+	// been seen so far, and FTCH has nothing to pick with. There's just the
+	// one stored frame.
+	/* uint32 slot = */ _file->readUint32BE();
+	return true;
 }
 
 bool SMUSHVideo::handleFetch(uint32 size) {
@@ -624,57 +984,163 @@ bool SMUSHVideo::handleFetch(uint32 size) {
 	if (size >= 12)
 		yOffset = _file->readSint32BE();
 
-	if (_storedFrame && _buffer) {
-		for (uint y = 0; y < _height; y++) {
-			int realY = yOffset + y;
-			if (realY < 0 || realY >= (int)_height)
-				continue;
+	// Any earlier fetch has to go first, since this one might not cover
+	// the whole frame
+	applyPendingFetch();
+	_fetchPending = true;
+	_fetchX = xOffset;
+	_fetchY = yOffset;
+	return true;
+}
+
+void SMUSHVideo::applyPendingFetch() {
+	if (!_fetchPending)
+		return;
 
-			for (uint x = 0; x < _width; x++) {
-				int realX = xOffset + x;
-				if (realX < 0 || realX >= (int)_width)	
-					continue;
+	_fetchPending = false;
 
-				_buffer[realY * _pitch + realX] = _storedFrame[y * _pitch + x];
-			}
-		}
+	if (_buffer) {
+		flushSkippedFrame();
+		_frameStore.prepareWrite(_buffer);
+		_frameStore.fetch(_buffer, _width, _height, _pitch, _fetchX, _fetchY);
+		_dirtyRegion.addAll();
+		_bufferCodec = 0;
+	}
+}
+
+bool SMUSHVideo::storeLargeFrameObject(SeekableReadStream *stream, byte codec, int left, int top, uint width, uint height, uint32 size) {
+	// A frame object that doesn't fit on the screen is being stored. Keep
+	// a region covering both the screen and the object, so that later
+	// fetches can move any part of it into view. The screen itself is
+	// left alone, as with any other frame object that doesn't fit.
+	int regionLeft = MIN<int>(left, 0);
+	int regionTop = MIN<int>(top, 0);
+	uint regionWidth = MAX<int>(left + width, _width) - regionLeft;
+	uint regionHeight = MAX<int>(top + height, _height) - regionTop;
+	_storeFrame = false;
+
+	if (regionWidth > kMaxStoredRegionSize || regionHeight > kMaxStoredRegionSize) {
+		fprintf(stderr, "Stored codec %d frame object too large: %d, %d, %d, %d\n", codec, left, top, width, height);
+		return true;
 	}
 
+	byte *region = _frameStore.storeRegion(regionLeft, regionTop, regionWidth, regionHeight);
+
+	if (!region)
+		return true;
+
+	// Start with what's on the screen, with nothing around it
+	flushSkippedFrame();
+	memset(region, 0, regionWidth * regionHeight);
+
+	for (uint y = 0; y < _height; y++)
+		memcpy(region + (y - regionTop) * regionWidth - regionLeft, _buffer + y * _pitch, _width);
+
+	// The region is exactly as big as it needs to be, so this relies on
+	// the line decoders stopping at the object's width and decodeLines()
+	// at its height. Oversized objects are the ones most likely to have
+	// runs that go too far.
+	byte *ptr = new byte[size];
+	stream->read(ptr, size);
+	decodeLines(getLineDecoder(codec), ptr, size, region + (top - regionTop) * regionWidth + (left - regionLeft), regionWidth, width, height);
+	delete[] ptr;
 	return true;
 }
 
-void SMUSHVideo::decodeCodec1(SeekableReadStream *stream, int left, int top, uint width, uint height) {
-	// This is very similar to the bomp compression
-	for (uint y = 0; y < height; y++) {
-		uint16 lineSize = stream->readUint16LE();
-		byte *dst = _buffer + (top + y) * _pitch + left;
+struct LineDecodeJob {
+	SMUSHVideo::LineDecoder decoder;
+	const std::vector<const byte *> *lines;
+	byte *dst;
+	uint pitch, width, bandHeight;
+};
+
+static void decodeLineBand(void *param, int index) {
+	const LineDecodeJob *job = (const LineDecodeJob *)param;
+	const std::vector<const byte *> &lines = *job->lines;
+	uint lineCount = lines.size() - 1;
+	uint start = index * job->bandHeight;
+	uint end = MIN(start + job->bandHeight, lineCount);
+
+	for (uint y = start; y < end; y++)
+		job->decoder(job->dst + y * job->pitch, lines[y] + 2, lines[y + 1], job->width);
+}
 
-		while (lineSize > 0) {
-			byte code = stream->readByte();
-			lineSize--;
-			byte length = (code >> 1) + 1;
+void SMUSHVideo::decodeLines(LineDecoder decoder, const byte *src, uint32 size, byte *dst, uint pitch, uint width, uint height) {
+	// Every line of these codecs starts with its size, so find where all
+	// of them are first. Then the lines are independent of each other.
+	const byte *end = src + size;
+	_lineStarts.clear();
 
-			if (code & 1) {
-				byte val = stream->readByte();
-				lineSize--;
+	for (uint y = 0; y < height && end - src >= 2; y++) {
+		_lineStarts.push_back(src);
+		src += 2 + MIN<uint32>(READ_LE_UINT16(src), end - src - 2);
+	}
 
-				if (val != 0)
-					memset(dst, val, length);
+	// The end of the last line
+	_lineStarts.push_back(src);
+
+	LineDecodeJob job;
+	job.decoder = decoder;
+	job.lines = &_lineStarts;
+	job.dst = dst;
+	job.pitch = pitch;
+	job.width = width;
+	job.bandHeight = _lineStarts.size() - 1;
+
+	// Only split big objects up, smaller ones aren't worth waking the
+	// other threads for
+	if (_threadPool && width * height >= kParallelDecodeMinPixels) {
+		int bands = MIN<int>(_threadPool->getThreadCount() * 2, job.bandHeight / kMinBandHeight);
+
+		if (bands > 1) {
+			job.bandHeight = (job.bandHeight + bands - 1) / bands;
+			_threadPool->run(decodeLineBand, &job, (_lineStarts.size() - 1 + job.bandHeight - 1) / job.bandHeight);
+			return;
+		}
+	}
 
-				dst += length;
-			} else {
-				lineSize -= length;
+	decodeLineBand(&job, 0);
+}
 
-				while (length--) {
-					byte val = stream->readByte();
+SMUSHVideo::LineDecoder SMUSHVideo::getLineDecoder(byte codec) {
+	switch (codec) {
+	case 1:
+	case 3:
+		return decodeCodec1Line;
+	case 21:
+		return decodeCodec21Line;
+	case 31:
+		return decodeCodec31Line;
+	case 32:
+		return decodeCodec32Line;
+	}
 
-					if (val)
-						*dst = val;
+	return 0;
+}
 
-					dst++;
-				}
-			}
+void SMUSHVideo::decodeCodec1Line(byte *dst, const byte *src, const byte *end, uint width) {
+	// This is very similar to the bomp compression. Runs are cut off at the
+	// end of the line, since other lines may be decoded at the same time.
+	while (src < end && width > 0) {
+		byte code = *src++;
+		uint length = MIN<uint>((code >> 1) + 1, width);
+
+		if (code & 1) {
+			if (src == end)
+				break;
+
+			byte val = *src++;
+
+			if (val != 0)
+				memset(dst, val, length);
+		} else {
+			uint count = MIN<uint>(length, end - src);
+			blitTransparent(dst, src, count);
+			src += count;
 		}
+
+		dst += length;
+		width -= length;
 	}
 }
 
@@ -883,13 +1349,14 @@ bool SMUSHVideo::bufferIMuseAudio(uint32 size, uint16 trackFlags) {
 bool SMUSHVideo::bufferIACTAudio(uint32 size) {
 	// Queue IACT audio (22050Hz)
 
+	if (size < 18)
+		return false;
+
 	if (!_iactStream) {
 		// Ignore _audioRate since it's always 22050Hz
 		// and CMI often lies and says 11025Hz
 		_iactStream = makeQueuingAudioStream(22050, 2);
 		_audio->play(_iactStream);
-		_iactPos = 0;
-		_iactBuffer = new byte[4096];
 	}
 
 	/* uint16 trackID = */ _file->readUint16LE();
@@ -898,70 +1365,69 @@ bool SMUSHVideo::bufferIACTAudio(uint32 size) {
 	/* uint32 bytesLeft = */ _file->readUint32LE();
 	size -= 18;
 
+	// The audio is a series of blocks, each with a big endian length in
+	// front. Blocks don't line up with the chunks.
+	const byte *src = readAudioChunk(size);
+
 	while (size > 0) {
-		if (_iactPos >= 2) {
-			uint32 length = READ_BE_UINT16(_iactBuffer) + 2;
-			length -= _iactPos;
-
-			if (length > size) {
-				_file->read(_iactBuffer + _iactPos, size);
-				_iactPos += size;
-				size = 0;
-			} else {
-				byte *output = new byte[4096];
-
-				_file->read(_iactBuffer + _iactPos, length);
-
-				byte *dst = output;
-				byte *src = _iactBuffer + 2;
-
-				int count = 1024;
-				byte var1 = *src++;
-				byte var2 = var1 >> 4;
-				var1 &= 0xF;
-
-				while (count--) {
-					byte value = *src++;
-					if (value == 0x80) {
-						*dst++ = *src++;
-						*dst++ = *src++;
-					} else {
-						int16 val = (int8)value << var2;
-						*dst++ = val >> 8;
-						*dst++ = (byte)val;
-					}
+		// Whole blocks are decoded straight from the chunk
+		if (_iactPos == 0 && size >= 2 && READ_BE_UINT16(src) + 2u <= size) {
+			uint32 length = READ_BE_UINT16(src) + 2;
+			queueIACTBlock(src + 2, length - 2);
+			src += length;
+			size -= length;
+			continue;
+		}
 
-					value = *src++;
-					if (value == 0x80) {
-						*dst++ = *src++;
-						*dst++ = *src++;
-					} else {
-						int16 val = (int8)value << var1;
-						*dst++ = val >> 8;
-						*dst++ = (byte)val;
-					}
-				}
+		// Otherwise, it continues in the next chunk, so gather it up in
+		// _iactBuffer. That starts with the length, so get that first.
+		uint32 length = (_iactPos < 2) ? 2 : READ_BE_UINT16(_iactBuffer.data()) + 2;
+
+		if (_iactBuffer.size() < length)
+			_iactBuffer.resize(length);
 
-				_iactStream->queueAudioStream(makePCMStream(output, 4096, _iactStream->getRate(), _iactStream->getChannels(), FLAG_16BITS));
-				size -= length;
+		uint32 count = MIN(length - _iactPos, size);
+		memcpy(_iactBuffer.data() + _iactPos, src, count);
+		_iactPos += count;
+		src += count;
+		size -= count;
+
+		if (_iactPos >= 2) {
+			length = READ_BE_UINT16(_iactBuffer.data()) + 2;
+
+			if (_iactPos == length) {
+				queueIACTBlock(_iactBuffer.data() + 2, length - 2);
 				_iactPos = 0;
 			}
-		} else {
-			if (size > 1 && _iactPos == 0) {
-				_iactBuffer[0] = _file->readByte();
-				_iactPos = 1;
-				size--;
-			}
-
-			_iactBuffer[_iactPos] = _file->readByte();
-			_iactPos++;
-			size--;
 		}
 	}
 
 	return true;
 }
 
+void SMUSHVideo::queueIACTBlock(const byte *src, uint32 size) {
+	int flags = FLAG_16BITS;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+	flags |= FLAG_LITTLE_ENDIAN;
+#endif
+
+	BufferPool &pool = _audio->getBufferPool();
+	byte *dst = pool.acquire(kIACTBlockSize);
+	decompressIACT(src, size, (int16 *)dst);
+
+	_iactStream->queueAudioStream(makePCMStream(dst, kIACTBlockSize, _iactStream->getRate(), _iactStream->getChannels(), flags, pool));
+}
+
+const byte *SMUSHVideo::readAudioChunk(uint32 &size) {
+	// The compressed data is only needed until it's decoded, so the buffer
+	// is kept for the next chunk
+	if (_chunkBuffer.size() < size)
+		_chunkBuffer.resize(size);
+
+	size = _file->read(_chunkBuffer.data(), size);
+	return _chunkBuffer.data();
+}
+
 bool SMUSHVideo::handleGhost(uint32 size) {
 	if (size != 12) {
 		fprintf(stderr, "Invalid ghost chunk (%d)\n", size);
@@ -991,40 +1457,33 @@ bool SMUSHVideo::handleGhost(uint32 size) {
 	return true;
 }
 
-void SMUSHVideo::decodeCodec21(SeekableReadStream *stream, int left, int top, uint width, uint height) {
-	for (uint y = 0; y < height; y++) {
-		byte *dst = _buffer + _pitch * (y + top) + left;
-		uint16 lineSize = stream->readUint16LE();
-		uint32 pos = stream->pos();
-
-		int len = width;
-		do {
-			int offs = stream->readUint16LE();
-			dst += offs;
-			len -= offs;
-			if (len <= 0)
-				break;
-
-			int w = stream->readUint16LE() + 1;
-			len -= w;
-			if (len < 0)
-				w += len;
-
-			for (int i = 0; i < w; i++) {
-				byte color = stream->readByte();
-
-				if (color != 0)
-					*dst = color;
+void SMUSHVideo::decodeCodec21Line(byte *dst, const byte *src, const byte *end, uint width) {
+	int len = width;
+	do {
+		if (end - src < 2)
+			break;
 
-				dst++;
-			}
-		} while (len > 0);
+		int offs = READ_LE_UINT16(src);
+		src += 2;
+		dst += offs;
+		len -= offs;
+		if (len <= 0 || end - src < 2)
+			break;
 
-		stream->seek(pos + lineSize, SEEK_SET);
-	}
+		int w = READ_LE_UINT16(src) + 1;
+		src += 2;
+		len -= w;
+		if (len < 0)
+			w += len;
+
+		w = MIN<int>(w, end - src);
+		blitTransparent(dst, src, w);
+		src += w;
+		dst += w;
+	} while (len > 0);
 }
 
-bool SMUSHVideo::handleBlocky16(GraphicsManager &gfx, uint32 size) {
+bool SMUSHVideo::handleBlocky16(uint32 size) {
 	if (!isHighColor()) {
 		fprintf(stderr, "Blocky16 chunk in 8bpp video\n");
 		return false;
@@ -1036,16 +1495,22 @@ bool SMUSHVideo::handleBlocky16(GraphicsManager &gfx, uint32 size) {
 	if (!_blocky16)
 		_blocky16 = new Blocky16(_width, _height);
 
-	if (!_buffer) {
-		_buffer = new byte[_pitch * _height];
-		memset(_buffer, 0, _pitch * _height);
-	}
+	if (!_buffer)
+		_buffer = allocFrameBuffer(_pitch * _height);
 
-	_blocky16->decode(_buffer, ptr);
+	applyPendingFetch();
 
-	delete[] ptr;
+	if (_presentFrame) {
+		_frameStore.prepareWrite(_buffer);
+		_blocky16->decode(_buffer, ptr, size);
+		_skippedCodec = 0;
+	} else {
+		_blocky16->decode(0, ptr, size);
+		_skippedCodec = 16;
+	}
 
-	gfx.blit(_buffer, 0, 0, _width, _height, _pitch);
+	delete[] ptr;
+	_dirtyRegion.addAll();
 	return true;
 }
 
@@ -1153,18 +1618,12 @@ bool SMUSHVideo::detectFrameSize() {
 
 	_file->seek(startPos, SEEK_SET);
 	_pitch = _width;
-	_buffer = new byte[_pitch * _height];
-	memset(_buffer, 0, _pitch * _height); // FIXME: Is this right?
+	_buffer = allocFrameBuffer(_pitch * _height); // FIXME: Is this right?
 	return true;
 }
 
 bool SMUSHVideo::handleVIMA(uint32 size) {
 	// VIMA Audio (SANM-only)
-	if (!_vimaDestTable) {
-		_vimaDestTable = new uint16[5786];
-		initVIMA(_vimaDestTable);
-	}
-
 	int flags = FLAG_16BITS;
 #if SDL_BYTEORDER == SDL_LIL_ENDIAN
 	flags |= FLAG_LITTLE_ENDIAN;
@@ -1183,15 +1642,15 @@ bool SMUSHVideo::handleVIMA(uint32 size) {
 		decompressedSize = _file->readUint32BE();
 	}
 
-	byte *src = new byte[size];
-	_file->read(src, size);
-
-	int16 *dst = new int16[decompressedSize * _audioChannels];
-	decompressVIMA(src, dst, decompressedSize * _audioChannels * 2, _vimaDestTable);
+	// The output goes to the stream, and comes back to the pool when the
+	// stream is done with it
+	const byte *src = readAudioChunk(size);
+	uint32 outSize = decompressedSize * _audioChannels * 2;
+	BufferPool &pool = _audio->getBufferPool();
+	byte *dst = pool.acquire(outSize);
+	decompressVIMA(src, size, (int16 *)dst, outSize);
 
-	delete[] src;
-
-	_iactStream->queueAudioStream(makePCMStream((byte *)dst, decompressedSize * _audioChannels * 2, _audioRate, _iactStream->getChannels(), flags));
+	_iactStream->queueAudioStream(makePCMStream(dst, outSize, _audioRate, _iactStream->getChannels(), flags, pool));
 	return true;
 }
 
@@ -1261,94 +1720,84 @@ bool operator<(const SMUSHTrackHandle &handle1, const SMUSHTrackHandle &handle2)
 	return false;
 }
 
-void SMUSHVideo::decodeCodec31(SeekableReadStream *stream, int left, int top, uint width, uint height) {
+void SMUSHVideo::decodeCodec31Line(byte *dst, const byte *src, const byte *end, uint width) {
 	// SegaCD-modified codec1 - uses high and low nibbles of the value to output
 	// Maps to palette #1, with transparency
+	// Runs are cut off at the end of the line, as with codec 1. Each byte is
+	// two pixels, so an odd width ends on half a pair.
+	while (src < end && width > 0) {
+		byte code = *src++;
+		uint length = (code >> 1) + 1;
+		uint pairs = MIN<uint>(length, width / 2);
+
+		if (code & 1) {
+			if (src == end)
+				break;
 
-	for (uint y = 0; y < height; y++) {
-		uint16 lineSize = stream->readUint16LE();
-		byte *dst = _buffer + (top + y) * _pitch + left;
-
-		while (lineSize > 0) {
-			byte code = stream->readByte();
-			lineSize--;
-			byte length = (code >> 1) + 1;
-
-			if (code & 1) {
-				byte val = stream->readByte();
-				lineSize--;
-
-				byte pixel1 = val & 0xF;
-				byte pixel2 = val >> 4;
-
-				for (int i = 0; i < length; i++) {
-					if (pixel1 != 0)
-						dst[0] = pixel1 + 224;
+			byte val = *src++;
+			byte pixel1 = val & 0xF;
+			byte pixel2 = val >> 4;
 
-					if (pixel2 != 0)
-						dst[1] = pixel2 + 224;
+			// A zero nibble is left transparent
+			fillPixelPairs(dst, pixel1 ? pixel1 + 224 : 0, pixel2 ? pixel2 + 224 : 0, pairs, true);
 
-					dst += 2;
-				}
-			} else {
-				lineSize -= length;
+			if (pairs < length && (width & 1) && pixel1)
+				dst[pairs * 2] = pixel1 + 224;
+		} else {
+			length = MIN<uint>(length, end - src);
+			pairs = MIN(pairs, length);
+			unpackNibbles(dst, src, pairs, 224, true);
 
-				while (length--) {
-					byte val = stream->readByte();
-					byte pixel1 = val & 0xF;
-					byte pixel2 = val >> 4;
+			if (pairs < length && (width & 1) && (src[pairs] & 0xF))
+				dst[pairs * 2] = (src[pairs] & 0xF) + 224;
 
-					if (pixel1 != 0)
-						dst[0] = pixel1 + 224;
+			src += length;
+		}
 
-					if (pixel2 != 0)
-						dst[1] = pixel2 + 224;
+		if (pairs < length)
+			break;
 
-					dst += 2;
-				}
-			}
-		}
+		dst += length * 2;
+		width -= length * 2;
 	}
 }
 
-void SMUSHVideo::decodeCodec32(SeekableReadStream *stream, int left, int top, uint width, uint height) {
+void SMUSHVideo::decodeCodec32Line(byte *dst, const byte *src, const byte *end, uint width) {
 	// SegaCD-modified codec1 - uses high and low nibbles of the value to output
 	// Maps to palette #2, no transparency
+	// Runs are cut off at the end of the line, as in codec 31
+	while (src < end && width > 0) {
+		byte code = *src++;
+		uint length = (code >> 1) + 1;
+		uint pairs = MIN<uint>(length, width / 2);
+
+		if (code & 1) {
+			if (src == end)
+				break;
 
-	for (uint y = 0; y < height; y++) {
-		uint16 lineSize = stream->readUint16LE();
-		byte *dst = _buffer + (top + y) * _pitch + left;
+			byte val = *src++;
+			byte pixel1 = val & 0xF;
+			byte pixel2 = val >> 4;
 
-		while (lineSize > 0) {
-			byte code = stream->readByte();
-			lineSize--;
-			byte length = (code >> 1) + 1;
+			fillPixelPairs(dst, pixel1 + 224 + 16, pixel2 + 224 + 16, pairs, false);
 
-			if (code & 1) {
-				byte val = stream->readByte();
-				lineSize--;
+			if (pairs < length && (width & 1))
+				dst[pairs * 2] = pixel1 + 224 + 16;
+		} else {
+			length = MIN<uint>(length, end - src);
+			pairs = MIN(pairs, length);
+			unpackNibbles(dst, src, pairs, 224 + 16, false);
 
-				byte pixel1 = val & 0xF;
-				byte pixel2 = val >> 4;
+			if (pairs < length && (width & 1))
+				dst[pairs * 2] = (src[pairs] & 0xF) + 224 + 16;
 
-				for (int i = 0; i < length; i++) {
-					dst[0] = pixel1 + 224 + 16;
-					dst[1] = pixel2 + 224 + 16;
-					dst += 2;
-				}
-			} else {
-				lineSize -= length;
+			src += length;
+		}
 
-				while (length--) {
-					byte val = stream->readByte();
-					byte pixel1 = val & 0xF;
-					byte pixel2 = val >> 4;
+		if (pairs < length)
+			break;
 
-					dst[0] = pixel1 + 224 + 16;
-					dst[1] = pixel2 + 224 + 16;
-					dst += 2;
-				}
-			}
-		}
+		dst += length * 2;
+		width -= length * 2;
 	}
 }
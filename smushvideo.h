@@ -27,6 +27,9 @@
 #define SMUSHVIDEO_H
 
 #include <map>
+#include <vector>
+#include "dirtyregion.h"
+#include "framestore.h"
 #include "graphicsman.h"
 #include "types.h"
 
@@ -35,8 +38,10 @@ class Blocky16;
 class Codec37Decoder;
 class Codec47Decoder;
 class Codec48Decoder;
+class FramePacer;
 class SeekableReadStream;
 class SMUSHChannel;
+class ThreadPool;
 class QueuingAudioStream;
 
 struct SMUSHTrackHandle {
@@ -55,19 +60,59 @@ public:
 	bool load(const char *fileName);
 	void close();
 	bool isLoaded() const { return _file != 0; }
-	void play(GraphicsManager &gfx);
+	void play(GraphicsManager &gfx, FramePacer &pacer);
 
 	bool isHighColor() const;
 	uint getWidth() const;
 	uint getHeight() const;
 
+	/**
+	 * Decode big frame objects in bands across a thread pool, which is
+	 * shared with the GraphicsManager. Without one, everything is decoded
+	 * on the calling thread.
+	 */
+	void setThreadPool(ThreadPool *pool) { _threadPool = pool; }
+
+	/**
+	 * A snapshot of everything needed to carry on decoding from the next
+	 * frame: the file position, palettes, frame buffer, stored frame and
+	 * codec states, along with the frame number and any partly read IACT
+	 * audio block. Restoring one made at an earlier frame and decoding
+	 * forward gives random access, and play() carries on from there.
+	 * Audio that was already queued is not part of the state.
+	 */
+	typedef std::vector<byte> State;
+	void saveState(State &state) const;
+	bool loadState(GraphicsManager &gfx, const State &state);
+
+	/**
+	 * Runs through the video saving a state every interval frames, and
+	 * checks that decoding on from a reloaded state gives the same frame
+	 * buffer byte for byte.
+	 */
+	bool checkStates(GraphicsManager &gfx, uint interval);
+
+	/** Decodes a single line of a line-prefixed codec (1/3/21/31/32) */
+	typedef void (*LineDecoder)(byte *dst, const byte *src, const byte *end, uint width);
+
 private:
+	enum {
+		// Frame objects at least this big get decoded in parallel bands
+		kParallelDecodeMinPixels = 320 * 100,
+		kMinBandHeight = 8,
+
+		// Largest region (in either direction) kept for a stored frame
+		// object that doesn't fit on the screen
+		kMaxStoredRegionSize = 2048
+	};
+
 	SeekableReadStream *_file;
 	uint _frameRate;
 
 	// Header
 	uint32 _mainTag;
 	uint _version, _frameCount;
+	uint _curFrame;
 
 	// Palette
 	byte _palette[256 * 3];
@@ -78,19 +123,42 @@ private:
 	uint _width, _height, _pitch;
 	bool detectFrameSize();
 
-	// Stored Frame
+	// What changed in _buffer since it was last blitted. _bufferCodec is
+	// the full frame codec (47, or 0 for none) whose last output is still
+	// all of _buffer, so that its own dirty region can be used.
+	DirtyRegion _dirtyRegion;
+	int _bufferCodec;
+	void blitBuffer(GraphicsManager &gfx);
+
+	// Frames that won't be shown only keep the decoders' state up to date.
+	// If the last full frame didn't go into _buffer, _skippedCodec is the
+	// codec still holding it (37, 47, 48, or 16 for blocky16), otherwise 0.
+	bool _presentFrame;
+	int _skippedCodec;
+	void copySkippedFrame(byte *dst) const;
+	void flushSkippedFrame();
+
+	// Stored Frames
 	bool _storeFrame;
-	byte *_storedFrame;
+	FrameStore _frameStore;
+	bool storeLargeFrameObject(SeekableReadStream *stream, byte codec, int left, int top, uint width, uint height, uint32 size);
+
+	// A FTCH is only applied once something else uses _buffer, or at the
+	// end of the frame after it's been shown
+	bool _fetchPending;
+	int32 _fetchX, _fetchY;
+	void applyPendingFetch();
 
 	// Main Functions
 	bool readHeader();
-	bool handleFrame(GraphicsManager &gfx);
+	bool handleFrame(GraphicsManager &gfx, bool present = true);
+	bool decodeFrames(GraphicsManager &gfx, uint count, std::vector<byte> &frame);
 	bool readFrameHeader();
-	uint32 getNextFrameTime(uint32 curFrame) const;
+	int64 getFrameTime(uint32 frame) const; // in microseconds
 
 	// Frame Types
-	bool handleBlocky16(GraphicsManager &gfx, uint32 size);
-	bool handleFrameObject(GraphicsManager &gfx, uint32 size);
+	bool handleBlocky16(uint32 size);
+	bool handleFrameObject(uint32 size);
 	bool handleFetch(uint32 size);
 	bool handleGhost(uint32 size);
 	bool handleIACT(uint32 size);
@@ -99,14 +167,18 @@ private:
 	bool handleDeltaPalette(GraphicsManager &gfx, uint32 size);
 	bool handleSoundFrame(uint32 type, uint32 size);
 	bool handleVIMA(uint32 size);
-	bool handleZlibFrameObject(GraphicsManager &gfx, uint32 size);
+	bool handleZlibFrameObject(uint32 size);
 
 	// Codecs
-	bool handleFrameObject(GraphicsManager &gfx, SeekableReadStream *stream, uint32 size);
-	void decodeCodec1(SeekableReadStream *stream, int left, int top, uint width, uint height);
-	void decodeCodec21(SeekableReadStream *stream, int left, int top, uint width, uint height);
-	void decodeCodec31(SeekableReadStream *stream, int left, int top, uint width, uint height);
-	void decodeCodec32(SeekableReadStream *stream, int left, int top, uint width, uint height);
+	bool handleFrameObject(SeekableReadStream *stream, uint32 size);
+	void decodeLines(LineDecoder decoder, const byte *src, uint32 size, byte *dst, uint pitch, uint width, uint height);
+	static LineDecoder getLineDecoder(byte codec);
+	static void decodeCodec1Line(byte *dst, const byte *src, const byte *end, uint width);
+	static void decodeCodec21Line(byte *dst, const byte *src, const byte *end, uint width);
+	static void decodeCodec31Line(byte *dst, const byte *src, const byte *end, uint width);
+	static void decodeCodec32Line(byte *dst, const byte *src, const byte *end, uint width);
+	std::vector<const byte *> _lineStarts;
+	ThreadPool *_threadPool;
 	Codec37Decoder *_codec37;
 	Codec47Decoder *_codec47;
 	Codec48Decoder *_codec48;
@@ -125,9 +197,11 @@ private:
 	bool bufferIACTAudio(uint32 size);
 	AudioManager *_audio;
 	QueuingAudioStream *_iactStream;
-	byte *_iactBuffer;
+	std::vector<byte> _iactBuffer;
 	uint32 _iactPos;
-	uint16 *_vimaDestTable;
+	void queueIACTBlock(const byte *src, uint32 size);
+	std::vector<byte> _chunkBuffer;
+	const byte *readAudioChunk(uint32 &size);
 	SMUSHChannel *findAudioTrack(const SMUSHTrackHandle &track);
 	typedef std::map<SMUSHTrackHandle, SMUSHChannel *> ChannelMap;
 	ChannelMap _audioTracks;
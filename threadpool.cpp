@@ -0,0 +1,124 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <SDL.h>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threadCount) {
+	_mutex = SDL_CreateMutex();
+	_jobCond = SDL_CreateCond();
+	_doneCond = SDL_CreateCond();
+
+	_proc = 0;
+	_param = 0;
+	_count = _next = _pending = 0;
+	_quit = false;
+
+	if (threadCount <= 0)
+		threadCount = SDL_GetCPUCount();
+
+	for (int i = 1; i < threadCount; i++) {
+		SDL_Thread *thread = SDL_CreateThread(threadMain, "smushplay worker", this);
+
+		if (!thread)
+			break;
+
+		_threads.push_back(thread);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	SDL_LockMutex(_mutex);
+	_quit = true;
+	SDL_CondBroadcast(_jobCond);
+	SDL_UnlockMutex(_mutex);
+
+	for (uint i = 0; i < _threads.size(); i++)
+		SDL_WaitThread(_threads[i], 0);
+
+	SDL_DestroyCond(_doneCond);
+	SDL_DestroyCond(_jobCond);
+	SDL_DestroyMutex(_mutex);
+}
+
+void ThreadPool::run(JobProc proc, void *param, int count) {
+	if (count <= 0)
+		return;
+
+	if (_threads.empty() || count == 1) {
+		for (int i = 0; i < count; i++)
+			proc(param, i);
+
+		return;
+	}
+
+	SDL_LockMutex(_mutex);
+	_proc = proc;
+	_param = param;
+	_count = _pending = count;
+	_next = 0;
+	SDL_CondBroadcast(_jobCond);
+
+	// Help out instead of just waiting
+	while (runNextJob())
+		;
+
+	while (_pending != 0)
+		SDL_CondWait(_doneCond, _mutex);
+
+	_proc = 0;
+	_param = 0;
+	SDL_UnlockMutex(_mutex);
+}
+
+bool ThreadPool::runNextJob() {
+	// Called with the mutex held
+	if (_next >= _count)
+		return false;
+
+	int index = _next++;
+	JobProc proc = _proc;
+	void *param = _param;
+
+	SDL_UnlockMutex(_mutex);
+	proc(param, index);
+	SDL_LockMutex(_mutex);
+
+	if (--_pending == 0)
+		SDL_CondSignal(_doneCond);
+
+	return true;
+}
+
+int ThreadPool::threadMain(void *param) {
+	ThreadPool *pool = (ThreadPool *)param;
+
+	SDL_LockMutex(pool->_mutex);
+
+	while (!pool->_quit) {
+		if (!pool->runNextJob())
+			SDL_CondWait(pool->_jobCond, pool->_mutex);
+	}
+
+	SDL_UnlockMutex(pool->_mutex);
+	return 0;
+}
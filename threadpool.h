@@ -0,0 +1,68 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <SDL_thread.h>
+#include <vector>
+#include "types.h"
+
+/**
+ * A small fixed-size pool of worker threads for splitting a job into
+ * independent pieces, such as bands of rows in a frame.
+ */
+class ThreadPool {
+public:
+	typedef void (*JobProc)(void *param, int index);
+
+	/**
+	 * Create a pool. A thread count of 0 uses one thread per CPU. The
+	 * thread calling run() counts as one of them.
+	 */
+	ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	/** Get the number of threads that work on a job, including the caller */
+	int getThreadCount() const { return _threads.size() + 1; }
+
+	/**
+	 * Call proc(param, i) for every i in [0, count) and wait until all of
+	 * them have finished. Calls may run in any order and concurrently.
+	 */
+	void run(JobProc proc, void *param, int count);
+
+private:
+	static int threadMain(void *param);
+	bool runNextJob();
+
+	std::vector<SDL_Thread *> _threads;
+	SDL_mutex *_mutex;
+	SDL_cond *_jobCond, *_doneCond;
+
+	JobProc _proc;
+	void *_param;
+	int _count, _next, _pending;
+	bool _quit;
+};
+
+#endif
@@ -22,10 +22,12 @@
 
 // Based on the ResidualVM code of the same name (LGPL v2.1)
 
+#include <string.h>
+#include <SDL_endian.h>
 #include "util.h"
 #include "vima.h"
 
-static const int16 imcTable1[] = {
+static constexpr int16 imcTable1[] = {
 	  7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
 	 19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
 	 50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
@@ -37,7 +39,7 @@ static const int16 imcTable1[] = {
 	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
 };
 
-static const int8 imcTable2[] = {
+static constexpr int8 imcTable2[] = {
 	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
 	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
 	4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5,
@@ -45,27 +47,27 @@ static const int8 imcTable2[] = {
 	6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
 };
 
-static const int8 imcOtherTable1[] = {
+static constexpr int8 imcOtherTable1[] = {
 	-1, 4, -1, 4
 };
 
-static const int8 imcOtherTable2[] = {
+static constexpr int8 imcOtherTable2[] = {
 	-1, -1, 2, 6, -1, -1, 2, 6
 };
 
-static const int8 imcOtherTable3[] = {
+static constexpr int8 imcOtherTable3[] = {
 	-1, -1, -1, -1, 1, 2, 4, 6,
 	-1, -1, -1, -1, 1, 2, 4, 6
 };
 
-static const int8 imcOtherTable4[] = {
+static constexpr int8 imcOtherTable4[] = {
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	1, 1, 1, 2, 2, 4, 5, 6,
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	1, 1, 1, 2, 2, 4, 5, 6
 };
 
-static const int8 imcOtherTable5[] = {
+static constexpr int8 imcOtherTable5[] = {
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	 1, 1, 1, 1, 1, 2, 2, 2,
@@ -76,7 +78,7 @@ static const int8 imcOtherTable5[] = {
 	 2, 4, 4, 4, 5, 5, 6, 6
 };
 
-static const int8 imcOtherTable6[] = {
+static constexpr int8 imcOtherTable6[] = {
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1,
@@ -95,28 +97,125 @@ static const int8 imcOtherTable6[] = {
 	 5, 5, 5, 5, 6, 6, 6, 6
 };
 
-static const int8 *const offsets[] = {
+static constexpr const int8 *offsets[] = {
 	imcOtherTable1, imcOtherTable2, imcOtherTable3,
 	imcOtherTable4, imcOtherTable5, imcOtherTable6
 };
 
-void initVIMA(uint16 *destTable) {
-	for (int destTableStartPos = 0, incer = 0; destTableStartPos < 64; destTableStartPos++, incer++) {
-		for (uint32 imcTable1Pos = 0, destTablePos = destTableStartPos; imcTable1Pos < sizeof(imcTable1) / sizeof(imcTable1[0]); imcTable1Pos++, destTablePos += 64) {
-			int put = 0;
+enum {
+	kTableSize = ARRAYSIZE(imcTable1)
+};
+
+// The step size for each combination of table position and the 6 bits
+// below a sample's sign bit. For everything but 0, this includes the
+// rounding term of half the step size (at the sample's bit width), so
+// decoding only needs the one lookup.
+struct VIMADeltaTable {
+	uint16 deltas[kTableSize * 64];
+};
+
+static constexpr VIMADeltaTable makeDeltaTable() {
+	VIMADeltaTable table = {};
+
+	for (int pos = 0; pos < kTableSize; pos++) {
+		int numBits = imcTable2[pos];
+
+		for (int bits = 0; bits < 64; bits++) {
+			int delta = 0;
+
+			for (int bit = 32, step = imcTable1[pos]; bit != 0; bit >>= 1, step >>= 1)
+				if (bits & bit)
+					delta += step;
+
+			if (bits != 0)
+				delta += imcTable1[pos] >> (numBits - 1);
+
+			table.deltas[(pos << 6) | bits] = delta;
+		}
+	}
 
-			for (int count = 32, tableValue = imcTable1[imcTable1Pos]; count != 0; count >>= 1, tableValue >>= 1)
-				if (incer & count)
-					put += tableValue;
+	return table;
+}
+
+static constexpr VIMADeltaTable s_deltaTable = makeDeltaTable();
+
+// The table position that follows each combination of table position and
+// sample bits (without the sign bit), already clamped to the table
+struct VIMAStepTable {
+	byte nextPos[kTableSize * 64];
+};
+
+static constexpr VIMAStepTable makeStepTable() {
+	VIMAStepTable table = {};
+
+	for (int pos = 0; pos < kTableSize; pos++) {
+		int numBits = imcTable2[pos];
 
-			destTable[destTablePos] = put;
+		for (int val = 0; val < (1 << (numBits - 1)); val++) {
+			int next = pos + offsets[numBits - 2][val];
+			table.nextPos[(pos << 6) | val] = (next < 0) ? 0 : (next > kTableSize - 1) ? kTableSize - 1 : next;
 		}
 	}
+
+	return table;
 }
 
-void decompressVIMA(const byte *src, int16 *dest, int destLen, uint16 *destTable) {
+static constexpr VIMAStepTable s_stepTable = makeStepTable();
+
+// An MSB first bit reader, refilled 64 bits at a time. Reading past the
+// end of the data gives zeros.
+class VIMABitReader {
+public:
+	VIMABitReader(const byte *src, const byte *end) : _src(src), _end(end), _bits(0), _count(0) {
+		refill();
+	}
+
+	// Make sure at least 57 bits are buffered
+	void refill() {
+		if (_end - _src >= 8) {
+			uint64 word;
+			memcpy(&word, _src, 8);
+
+			// The bits past the last whole byte get ORed in again, at the
+			// same place, by the next refill
+			_bits |= SDL_SwapBE64(word) >> _count;
+			_src += (63 - _count) >> 3;
+			_count |= 56;
+		} else {
+			while (_count <= 56) {
+				uint64 value = (_src < _end) ? *_src++ : 0;
+				_bits |= value << (56 - _count);
+				_count += 8;
+			}
+		}
+	}
+
+	int count() const { return _count; }
+
+	uint32 get(int numBits) {
+		uint32 value = (uint32)(_bits >> (64 - numBits));
+		_bits <<= numBits;
+		_count -= numBits;
+		return value;
+	}
+
+private:
+	const byte *_src, *_end;
+	uint64 _bits;
+	int _count;
+};
+
+void decompressVIMA(const byte *src, uint32 srcSize, int16 *dest, int destLen) {
+	const byte *end = src + srcSize;
 	int numChannels = 1;
 	byte sBytes[2];
+	int16 sWords[2];
+
+	// The header is 3 bytes per channel
+	if (srcSize < 3) {
+		memset(dest, 0, destLen);
+		return;
+	}
 
 	sBytes[0] = *src++;
 	if (sBytes[0] & 0x80) {
@@ -124,73 +223,51 @@ void decompressVIMA(const byte *src, int16 *dest, int destLen, uint16 *destTable
 		numChannels = 2;
 	}
 
-	int16 sWords[2];
 	sWords[0] = READ_BE_UINT16(src);
 	src += 2;
 	if (numChannels > 1) {
+		if (end - src < 3) {
+			memset(dest, 0, destLen);
+			return;
+		}
+
 		sBytes[1] = *src++;
 		sWords[1] = READ_BE_UINT16(src);
 		src += 2;
 	}
 
 	int numSamples = destLen / (numChannels * 2);
-	int bits = READ_BE_UINT16(src);
-	int bitPtr = 0;
-	src += 2;
+	VIMABitReader reader(src, end);
 
 	for (int channel = 0; channel < numChannels; channel++) {
 		int16 *destPos = dest + channel;
-		int currTablePos = sBytes[channel];
+		int currTablePos = MIN<int>(sBytes[channel], kTableSize - 1);
 		int outputWord = sWords[channel];
 
 		for (int sample = 0; sample < numSamples; sample++) {
-			int numBits = imcTable2[currTablePos];
-			bitPtr += numBits;
-			int highBit = 1 << (numBits - 1);
-			int lowBits = highBit - 1;
-			int val = (bits >> (16 - bitPtr)) & (highBit | lowBits);
-
-			if (bitPtr > 7) {
-				bits = ((bits & 0xff) << 8) | *src++;
-				bitPtr -= 8;
-			}
+			// A sample takes at most 7 bits, plus 16 for a literal
+			if (reader.count() < 23)
+				reader.refill();
 
-			if (val & highBit)
-				val ^= highBit;
-			else
-				highBit = 0;
+			int numBits = imcTable2[currTablePos];
+			int val = reader.get(numBits);
+			int sign = val >> (numBits - 1);
+			int lowBits = (1 << (numBits - 1)) - 1;
+			val &= lowBits;
 
+			// All ones is a literal sample
 			if (val == lowBits) {
-				outputWord = ((int16)(bits << bitPtr) & 0xffffff00);
-				bits = ((bits & 0xff) << 8) | *src++;
-				outputWord |= ((bits >> (8 - bitPtr)) & 0xff);
-				bits = ((bits & 0xff) << 8) | *src++;
+				outputWord = (int16)reader.get(16);
 			} else {
-				int index = (val << (7 - numBits)) | (currTablePos << 6);
-				int delta = destTable[index];
-
-				if (val)
-					delta += (imcTable1[currTablePos] >> (numBits - 1));
-				if (highBit)
-					delta = -delta;
-
-				outputWord += delta;
-				if (outputWord < -0x8000)
-					outputWord = -0x8000;
-				else if (outputWord > 0x7fff)
-					outputWord = 0x7fff;
+				int delta = s_deltaTable.deltas[(val << (7 - numBits)) | (currTablePos << 6)];
+				delta = (delta ^ -sign) + sign;
+				outputWord = CLIP(outputWord + delta, -0x8000, 0x7fff);
 			}
 
-			*((uint16 *)destPos) = outputWord;
+			*destPos = outputWord;
 			destPos += numChannels;
 
-			currTablePos += offsets[numBits - 2][val];
-
-			if (currTablePos < 0)
-				currTablePos = 0;
-			else if (currTablePos > 88)
-				currTablePos = 88;
+			currTablePos = s_stepTable.nextPos[(currTablePos << 6) | val];
 		}
 	}
 }
-
@@ -27,7 +27,8 @@
 
 #include "types.h"
 
-void initVIMA(uint16 *destTable);
-void decompressVIMA(const byte *src, int16 *dest, int destLen, uint16 *destTable);
+// Decode a VIMA chunk into destLen bytes of native endian 16-bit samples.
+// Data missing from the end of the chunk decodes as zero bits.
+void decompressVIMA(const byte *src, uint32 srcSize, int16 *dest, int destLen);
 
 #endif